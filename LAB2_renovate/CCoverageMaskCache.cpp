@@ -0,0 +1,70 @@
+#include "CCoverageMaskCache.h"
+
+bool CCoverageMaskCache::Key::operator==(const Key &other) const {
+  return thickness == other.thickness && dx == other.dx && dy == other.dy && fx == other.fx
+      && fy == other.fy && samples == other.samples;
+}
+
+size_t CCoverageMaskCache::KeyHash::operator()(const Key &key) const {
+  size_t h = (size_t) key.thickness;
+  h = h * 1000003u ^ (size_t) key.dx;
+  h = h * 1000003u ^ (size_t) key.dy;
+  h = h * 1000003u ^ (size_t) (key.fx * SUBPIXEL_STEPS + key.fy);
+  h = h * 1000003u ^ (size_t) key.samples;
+  return h;
+}
+
+CCoverageMaskCache::CCoverageMaskCache(size_t capacity_bytes)
+    : capacity_(capacity_bytes), bytes_(0), hits_(0), misses_(0) {
+}
+
+std::shared_ptr<const CCoverageMaskCache::Mask> CCoverageMaskCache::Find(const Key &key) {
+  std::lock_guard<std::mutex> guard(lock_);
+  auto it = index_.find(key);
+  if (it == index_.end()) {
+    misses_++;
+    return nullptr;
+  }
+  hits_++;
+  entries_.splice(entries_.begin(), entries_, it->second);
+  return it->second->second;
+}
+
+void CCoverageMaskCache::Insert(const Key &key, const std::shared_ptr<const Mask> &mask) {
+  std::lock_guard<std::mutex> guard(lock_);
+  if (index_.count(key) || mask->alpha.size() > capacity_) {
+    return;
+  }
+  entries_.emplace_front(key, mask);
+  index_[key] = entries_.begin();
+  bytes_ += mask->alpha.size();
+  while (bytes_ > capacity_) {
+    bytes_ -= entries_.back().second->alpha.size();
+    index_.erase(entries_.back().first);
+    entries_.pop_back();
+  }
+}
+
+void CCoverageMaskCache::Clear() {
+  std::lock_guard<std::mutex> guard(lock_);
+  entries_.clear();
+  index_.clear();
+  bytes_ = 0;
+  hits_ = 0;
+  misses_ = 0;
+}
+
+size_t CCoverageMaskCache::GetHits() const {
+  std::lock_guard<std::mutex> guard(lock_);
+  return hits_;
+}
+
+size_t CCoverageMaskCache::GetMisses() const {
+  std::lock_guard<std::mutex> guard(lock_);
+  return misses_;
+}
+
+size_t CCoverageMaskCache::GetSize() const {
+  std::lock_guard<std::mutex> guard(lock_);
+  return entries_.size();
+}
@@ -0,0 +1,70 @@
+#ifndef COMPUTERGEOMETRY_GRAPHICS_CCOVERAGEMASKCACHE_H
+#define COMPUTERGEOMETRY_GRAPHICS_CCOVERAGEMASKCACHE_H
+
+#include <cstddef>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+typedef unsigned char uchar;
+
+// LRU cache of rasterized stroke coverage, shared between images and frames.
+// A mask is stored relative to the integer pixel its stroke starts in, so the
+// same key can be blitted anywhere on the canvas. Thread-safe.
+class CCoverageMaskCache {
+ public:
+  // Thickness and segment vector are quantized to 1 / GEOMETRY_STEPS px,
+  // the start point's position inside its pixel to 1 / SUBPIXEL_STEPS px
+  static const int GEOMETRY_STEPS = 8;
+  static const int SUBPIXEL_STEPS = 4;
+
+  struct Key {
+    int thickness;
+    int dx, dy;
+    int fx, fy;
+    // Edge sampling rate the mask was rasterized with
+    int samples;
+
+    bool operator==(const Key &other) const;
+  };
+
+  struct Mask {
+    int x0, y0;
+    int w, h;
+    std::vector<uchar> alpha;
+  };
+
+  explicit CCoverageMaskCache(size_t capacity_bytes = 16 << 20);
+
+  std::shared_ptr<const Mask> Find(const Key &key);
+
+  void Insert(const Key &key, const std::shared_ptr<const Mask> &mask);
+
+  void Clear();
+
+  size_t GetHits() const;
+
+  size_t GetMisses() const;
+
+  size_t GetSize() const;
+
+ private:
+  struct KeyHash {
+    size_t operator()(const Key &key) const;
+  };
+
+  typedef std::list<std::pair<Key, std::shared_ptr<const Mask>>> Entries;
+
+  mutable std::mutex lock_;
+  Entries entries_;
+  std::unordered_map<Key, Entries::iterator, KeyHash> index_;
+  size_t capacity_;
+  size_t bytes_;
+  size_t hits_;
+  size_t misses_;
+};
+
+#endif //COMPUTERGEOMETRY_GRAPHICS_CCOVERAGEMASKCACHE_H
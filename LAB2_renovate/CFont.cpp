@@ -0,0 +1,221 @@
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+#include "CFont.h"
+#include "CImageFileFormatException.h"
+#include "CImageFileOpenException.h"
+
+namespace {
+
+// Classic 5x7 LCD font for ' ' .. '~', one byte per column, bit 0 on top
+const uchar FONT_5X7[95][5] = {
+    {0x00, 0x00, 0x00, 0x00, 0x00}, {0x00, 0x00, 0x5F, 0x00, 0x00}, {0x00, 0x07, 0x00, 0x07, 0x00},
+    {0x14, 0x7F, 0x14, 0x7F, 0x14}, {0x24, 0x2A, 0x7F, 0x2A, 0x12}, {0x23, 0x13, 0x08, 0x64, 0x62},
+    {0x36, 0x49, 0x55, 0x22, 0x50}, {0x00, 0x05, 0x03, 0x00, 0x00}, {0x00, 0x1C, 0x22, 0x41, 0x00},
+    {0x00, 0x41, 0x22, 0x1C, 0x00}, {0x08, 0x2A, 0x1C, 0x2A, 0x08}, {0x08, 0x08, 0x3E, 0x08, 0x08},
+    {0x00, 0x50, 0x30, 0x00, 0x00}, {0x08, 0x08, 0x08, 0x08, 0x08}, {0x00, 0x60, 0x60, 0x00, 0x00},
+    {0x20, 0x10, 0x08, 0x04, 0x02}, {0x3E, 0x51, 0x49, 0x45, 0x3E}, {0x00, 0x42, 0x7F, 0x40, 0x00},
+    {0x42, 0x61, 0x51, 0x49, 0x46}, {0x21, 0x41, 0x45, 0x4B, 0x31}, {0x18, 0x14, 0x12, 0x7F, 0x10},
+    {0x27, 0x45, 0x45, 0x45, 0x39}, {0x3C, 0x4A, 0x49, 0x49, 0x30}, {0x01, 0x71, 0x09, 0x05, 0x03},
+    {0x36, 0x49, 0x49, 0x49, 0x36}, {0x06, 0x49, 0x49, 0x29, 0x1E}, {0x00, 0x36, 0x36, 0x00, 0x00},
+    {0x00, 0x56, 0x36, 0x00, 0x00}, {0x08, 0x14, 0x22, 0x41, 0x00}, {0x14, 0x14, 0x14, 0x14, 0x14},
+    {0x00, 0x41, 0x22, 0x14, 0x08}, {0x02, 0x01, 0x51, 0x09, 0x06}, {0x32, 0x49, 0x79, 0x41, 0x3E},
+    {0x7E, 0x11, 0x11, 0x11, 0x7E}, {0x7F, 0x49, 0x49, 0x49, 0x36}, {0x3E, 0x41, 0x41, 0x41, 0x22},
+    {0x7F, 0x41, 0x41, 0x22, 0x1C}, {0x7F, 0x49, 0x49, 0x49, 0x41}, {0x7F, 0x09, 0x09, 0x01, 0x01},
+    {0x3E, 0x41, 0x41, 0x51, 0x32}, {0x7F, 0x08, 0x08, 0x08, 0x7F}, {0x00, 0x41, 0x7F, 0x41, 0x00},
+    {0x20, 0x40, 0x41, 0x3F, 0x01}, {0x7F, 0x08, 0x14, 0x22, 0x41}, {0x7F, 0x40, 0x40, 0x40, 0x40},
+    {0x7F, 0x02, 0x04, 0x02, 0x7F}, {0x7F, 0x04, 0x08, 0x10, 0x7F}, {0x3E, 0x41, 0x41, 0x41, 0x3E},
+    {0x7F, 0x09, 0x09, 0x09, 0x06}, {0x3E, 0x41, 0x51, 0x21, 0x5E}, {0x7F, 0x09, 0x19, 0x29, 0x46},
+    {0x46, 0x49, 0x49, 0x49, 0x31}, {0x01, 0x01, 0x7F, 0x01, 0x01}, {0x3F, 0x40, 0x40, 0x40, 0x3F},
+    {0x1F, 0x20, 0x40, 0x20, 0x1F}, {0x7F, 0x20, 0x18, 0x20, 0x7F}, {0x63, 0x14, 0x08, 0x14, 0x63},
+    {0x03, 0x04, 0x78, 0x04, 0x03}, {0x61, 0x51, 0x49, 0x45, 0x43}, {0x00, 0x7F, 0x41, 0x41, 0x00},
+    {0x02, 0x04, 0x08, 0x10, 0x20}, {0x00, 0x41, 0x41, 0x7F, 0x00}, {0x04, 0x02, 0x01, 0x02, 0x04},
+    {0x40, 0x40, 0x40, 0x40, 0x40}, {0x00, 0x01, 0x02, 0x04, 0x00}, {0x20, 0x54, 0x54, 0x54, 0x78},
+    {0x7F, 0x48, 0x44, 0x44, 0x38}, {0x38, 0x44, 0x44, 0x44, 0x20}, {0x38, 0x44, 0x44, 0x48, 0x7F},
+    {0x38, 0x54, 0x54, 0x54, 0x18}, {0x08, 0x7E, 0x09, 0x01, 0x02}, {0x08, 0x14, 0x54, 0x54, 0x3C},
+    {0x7F, 0x08, 0x04, 0x04, 0x78}, {0x00, 0x44, 0x7D, 0x40, 0x00}, {0x20, 0x40, 0x44, 0x3D, 0x00},
+    {0x00, 0x7F, 0x10, 0x28, 0x44}, {0x00, 0x41, 0x7F, 0x40, 0x00}, {0x7C, 0x04, 0x18, 0x04, 0x78},
+    {0x7C, 0x08, 0x04, 0x04, 0x78}, {0x38, 0x44, 0x44, 0x44, 0x38}, {0x7C, 0x14, 0x14, 0x14, 0x08},
+    {0x08, 0x14, 0x14, 0x18, 0x7C}, {0x7C, 0x08, 0x04, 0x04, 0x08}, {0x48, 0x54, 0x54, 0x54, 0x20},
+    {0x04, 0x3F, 0x44, 0x40, 0x20}, {0x3C, 0x40, 0x40, 0x20, 0x7C}, {0x1C, 0x20, 0x40, 0x20, 0x1C},
+    {0x3C, 0x40, 0x30, 0x40, 0x3C}, {0x44, 0x28, 0x10, 0x28, 0x44}, {0x0C, 0x50, 0x50, 0x50, 0x3C},
+    {0x44, 0x64, 0x54, 0x4C, 0x44}, {0x00, 0x08, 0x36, 0x41, 0x00}, {0x00, 0x00, 0x7F, 0x00, 0x00},
+    {0x00, 0x41, 0x36, 0x08, 0x00}, {0x02, 0x01, 0x02, 0x04, 0x02}
+};
+
+int HexDigit(char c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  c = (char) (c | 0x20);
+  if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  }
+  throw CImageFileFormatException();
+}
+
+}
+
+CFont::CFont()
+    : line_height_(8), ascent_(7) {
+  std::vector<Bitmap> bitmaps;
+  for (int c = 0; c < 95; c++) {
+    Bitmap bitmap;
+    bitmap.code = ' ' + c;
+    bitmap.glyph = {0, 5, 7, 0, 0, 6};
+    bitmap.alpha.resize(5 * 7);
+    for (int row = 0; row < 7; row++) {
+      for (int col = 0; col < 5; col++) {
+        bitmap.alpha[row * 5 + col] = (FONT_5X7[c][col] >> row & 1) ? 255 : 0;
+      }
+    }
+    bitmaps.push_back(bitmap);
+  }
+  Pack(bitmaps);
+}
+
+CFont::CFont(const std::string &fname)
+    : line_height_(0), ascent_(0) {
+  std::ifstream in(fname);
+  if (!in) {
+    throw CImageFileOpenException();
+  }
+  std::string line;
+  if (!std::getline(in, line) || line.compare(0, 9, "STARTFONT") != 0) {
+    throw CImageFileFormatException();
+  }
+
+  int box_h = 0;
+  int box_y = 0;
+  int ascent = -1;
+  int descent = -1;
+  std::vector<Bitmap> bitmaps;
+  Bitmap bitmap;
+  int box[4] = {0, 0, 0, 0};
+  int advance = -1;
+  while (std::getline(in, line)) {
+    std::istringstream str(line);
+    std::string word;
+    str >> word;
+    if (word == "FONTBOUNDINGBOX") {
+      int w;
+      str >> w >> box_h >> w >> box_y;
+    } else if (word == "FONT_ASCENT") {
+      str >> ascent;
+    } else if (word == "FONT_DESCENT") {
+      str >> descent;
+    } else if (word == "STARTCHAR") {
+      bitmap.code = -1;
+      advance = -1;
+      std::fill(box, box + 4, 0);
+    } else if (word == "ENCODING") {
+      str >> bitmap.code;
+    } else if (word == "DWIDTH") {
+      str >> advance;
+    } else if (word == "BBX") {
+      if (!(str >> box[0] >> box[1] >> box[2] >> box[3]) || box[0] < 0 || box[1] < 0) {
+        throw CImageFileFormatException();
+      }
+    } else if (word == "BITMAP") {
+      int w = box[0];
+      int h = box[1];
+      bitmap.glyph = {0, w, h, box[2], box[3] + h, advance >= 0 ? advance : w + box[2]};
+      bitmap.alpha.assign((size_t) w * h, 0);
+      for (int row = 0; row < h; row++) {
+        if (!std::getline(in, line)) {
+          throw CImageFileFormatException();
+        }
+        for (int col = 0; col < w; col++) {
+          if (col / 4 >= (int) line.size()) {
+            throw CImageFileFormatException();
+          }
+          int nibble = HexDigit(line[col / 4]);
+          bitmap.alpha[row * w + col] = (nibble >> (3 - col % 4) & 1) ? 255 : 0;
+        }
+      }
+      if (bitmap.code >= 0 && bitmap.code < 256) {
+        bitmaps.push_back(bitmap);
+      }
+    }
+  }
+  if (bitmaps.empty()) {
+    throw CImageFileFormatException();
+  }
+
+  if (ascent < 0 || descent < 0) {
+    ascent = box_h + box_y;
+    descent = -box_y;
+  }
+  ascent_ = ascent;
+  line_height_ = std::max(ascent + descent, 1);
+  // BBX offsets are from the baseline, y up; turn them into rows below the
+  // line top
+  for (Bitmap &b : bitmaps) {
+    b.glyph.top = ascent_ - b.glyph.top;
+  }
+  Pack(bitmaps);
+}
+
+void CFont::Pack(const std::vector<Bitmap> &bitmaps) {
+  std::fill(index_, index_ + 256, -1);
+  glyphs_.clear();
+  atlas_w_ = 0;
+  atlas_h_ = 1;
+  for (const Bitmap &b : bitmaps) {
+    atlas_w_ += b.glyph.w;
+    atlas_h_ = std::max(atlas_h_, b.glyph.h);
+  }
+  atlas_w_ = std::max(atlas_w_, 1);
+  atlas_.assign((size_t) atlas_w_ * atlas_h_, 0);
+  int x = 0;
+  for (const Bitmap &b : bitmaps) {
+    Glyph glyph = b.glyph;
+    glyph.x = x;
+    for (int row = 0; row < glyph.h; row++) {
+      std::copy(b.alpha.begin() + row * glyph.w, b.alpha.begin() + (row + 1) * glyph.w,
+                atlas_.begin() + (size_t) row * atlas_w_ + x);
+    }
+    x += glyph.w;
+    if (index_[b.code] < 0) {
+      index_[b.code] = (int) glyphs_.size();
+      glyphs_.push_back(glyph);
+    } else {
+      glyphs_[index_[b.code]] = glyph;
+    }
+  }
+}
+
+const CFont::Glyph *CFont::GetGlyph(uchar c) const {
+  int i = index_[c] >= 0 ? index_[c] : index_['?'];
+  return i >= 0 ? &glyphs_[i] : nullptr;
+}
+
+const uchar *CFont::GetRow(const Glyph &glyph, int row) const {
+  return &atlas_[(size_t) row * atlas_w_ + glyph.x];
+}
+
+int CFont::GetLineHeight() const {
+  return line_height_;
+}
+
+int CFont::GetAscent() const {
+  return ascent_;
+}
+
+int CFont::MeasureText(const std::string &text) const {
+  int width = 0;
+  int line = 0;
+  for (char c : text) {
+    if (c == '\n') {
+      line = 0;
+      continue;
+    }
+    const Glyph *glyph = GetGlyph((uchar) c);
+    if (glyph) {
+      line += glyph->advance;
+    }
+    width = std::max(width, line);
+  }
+  return width;
+}
@@ -0,0 +1,56 @@
+#ifndef COMPUTERGEOMETRY_GRAPHICS_CFONT_H
+#define COMPUTERGEOMETRY_GRAPHICS_CFONT_H
+
+#include <string>
+#include <vector>
+
+typedef unsigned char uchar;
+
+// Bitmap font packed into a single-strip coverage atlas: every glyph row is
+// a contiguous run of 0 / 255 alpha, ready to be handed to BlendSpan.
+// Characters are single bytes; glyphs outside 0..255 are dropped.
+class CFont {
+ public:
+  struct Glyph {
+    int x;          // column in the atlas
+    int w, h;
+    int left, top;  // offset of the bitmap from the pen / line top
+    int advance;
+  };
+
+  // Built-in 5x7 ASCII font
+  CFont();
+
+  // BDF (Glyph Bitmap Distribution Format) file
+  explicit CFont(const std::string &fname);
+
+  // nullptr when the font has neither the glyph nor '?'
+  const Glyph *GetGlyph(uchar c) const;
+
+  const uchar *GetRow(const Glyph &glyph, int row) const;
+
+  int GetLineHeight() const;
+
+  int GetAscent() const;
+
+  // Width of the widest line of text, in pixels at scale 1
+  int MeasureText(const std::string &text) const;
+
+ private:
+  struct Bitmap {
+    int code;
+    Glyph glyph;
+    std::vector<uchar> alpha;
+  };
+
+  std::vector<uchar> atlas_;
+  int atlas_w_, atlas_h_;
+  std::vector<Glyph> glyphs_;
+  int index_[256];
+  int line_height_;
+  int ascent_;
+
+  void Pack(const std::vector<Bitmap> &bitmaps);
+};
+
+#endif //COMPUTERGEOMETRY_GRAPHICS_CFONT_H
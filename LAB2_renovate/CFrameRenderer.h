@@ -0,0 +1,96 @@
+#ifndef COMPUTERGEOMETRY_GRAPHICS_CFRAMERENDERER_H
+#define COMPUTERGEOMETRY_GRAPHICS_CFRAMERENDERER_H
+
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "CImage.h"
+#include "CThreadPool.h"
+
+// Renders independent animation frames in parallel on top of a common
+// background. Frames are drawn into a ring of pooled buffers, each reset by
+// restoring only what its previous frame drew, and handed to the writer
+// strictly in frame order by one thread at a time.
+template<class T>
+class CFrameRenderer {
+ public:
+  typedef std::function<void(int frame, CImage<T> &img)> FrameFn;
+
+  // buffers <= 0 picks twice the thread count
+  explicit CFrameRenderer(const CImage<T> &background, int threads = 0, int buffers = 0);
+
+  void Render(int frames, const FrameFn &render, const FrameFn &write);
+
+ private:
+  const CImage<T> &background_;
+  CThreadPool pool_;
+  std::vector<std::unique_ptr<CImage<T>>> buffers_;
+};
+
+template<class T>
+CFrameRenderer<T>::CFrameRenderer(const CImage<T> &background, int threads, int buffers)
+    : background_(background), pool_(threads) {
+  if (buffers <= 0) {
+    buffers = 2 * pool_.GetThreadCount();
+  }
+  for (int i = 0; i < buffers; i++) {
+    buffers_.emplace_back(new CImage<T>(background));
+    buffers_.back()->TrackDirty(true);
+  }
+}
+
+template<class T>
+void CFrameRenderer<T>::Render(int frames, const FrameFn &render, const FrameFn &write) {
+  // Frame k uses buffer k % size and may only start once frame k - size has
+  // been written; the oldest unwritten frame can always proceed, so the
+  // ring never deadlocks
+  int size = (int) buffers_.size();
+  std::mutex lock;
+  std::condition_variable space;
+  std::vector<bool> ready(size, false);
+  int next_write = 0;
+  bool writing = false;
+  bool failed = false;
+
+  pool_.ParallelFor(frames, [&](int frame) {
+    std::unique_lock<std::mutex> guard(lock);
+    space.wait(guard, [&] { return failed || frame < next_write + size; });
+    if (failed) {
+      return;
+    }
+    guard.unlock();
+    CImage<T> &img = *buffers_[frame % size];
+    try {
+      img.RestoreDirty(background_);
+      render(frame, img);
+      guard.lock();
+      ready[frame % size] = true;
+      if (writing) {
+        return;
+      }
+      writing = true;
+      while (next_write < frames && ready[next_write % size]) {
+        int f = next_write;
+        guard.unlock();
+        write(f, *buffers_[f % size]);
+        guard.lock();
+        ready[f % size] = false;
+        next_write++;
+        space.notify_all();
+      }
+      writing = false;
+    } catch (...) {
+      if (!guard.owns_lock()) {
+        guard.lock();
+      }
+      failed = true;
+      space.notify_all();
+      throw;
+    }
+  });
+}
+
+#endif //COMPUTERGEOMETRY_GRAPHICS_CFRAMERENDERER_H
@@ -0,0 +1,35 @@
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <memory>
+#include <mutex>
+
+#include "CGammaLut.h"
+
+CGammaLut::CGammaLut(double gamma)
+    : gamma_(gamma) {
+  decode_[0] = 0;
+  for (int i = 1; i < 256; i++) {
+    int lin = (int) std::lround(std::pow(i / 255.0, gamma) * LINEAR_ONE);
+    // Keep the table strictly increasing so Blend(a, b, 0) == b round-trips
+    decode_[i] = std::max(lin, decode_[i - 1] + 1);
+  }
+  int val = 0;
+  for (int i = 0; i < ENCODE_SIZE; i++) {
+    while (val < 255 && decode_[val + 1] <= (i << ENCODE_SHIFT)) {
+      val++;
+    }
+    encode_[i] = (uchar) val;
+  }
+}
+
+const CGammaLut &CGammaLut::Get(double gamma) {
+  static std::mutex lock;
+  static std::map<double, std::unique_ptr<CGammaLut>> cache;
+  std::lock_guard<std::mutex> guard(lock);
+  std::unique_ptr<CGammaLut> &lut = cache[gamma];
+  if (!lut) {
+    lut.reset(new CGammaLut(gamma));
+  }
+  return *lut;
+}
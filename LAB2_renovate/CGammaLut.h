@@ -0,0 +1,70 @@
+#ifndef COMPUTERGEOMETRY_GRAPHICS_CGAMMALUT_H
+#define COMPUTERGEOMETRY_GRAPHICS_CGAMMALUT_H
+
+typedef unsigned char uchar;
+
+// Gamma-correct blending in integers: 8-bit values are decoded to fixed-point
+// linear light once per gamma, blended with an 8-bit alpha and encoded back
+// by table lookup, so no pow() is left in the per-pixel path.
+class CGammaLut {
+ public:
+  static const int LINEAR_BITS = 20;
+  static const int LINEAR_ONE = 1 << LINEAR_BITS;
+
+  explicit CGammaLut(double gamma);
+
+  static const CGammaLut &Get(double gamma);
+
+  double GetGamma() const {
+    return gamma_;
+  }
+
+  int Decode(uchar val) const {
+    return decode_[val];
+  }
+
+  uchar Encode(int lin) const {
+    if (lin <= 0) {
+      return 0;
+    }
+    if (lin >= LINEAR_ONE) {
+      return 255;
+    }
+    int val = encode_[lin >> ENCODE_SHIFT];
+    while (val < 255 && decode_[val + 1] <= lin) {
+      val++;
+    }
+    return (uchar) val;
+  }
+
+  uchar Blend(uchar fg, uchar bg, int alpha) const {
+    if (alpha <= 0) {
+      return bg;
+    }
+    if (alpha >= 255) {
+      return fg;
+    }
+    return Encode((decode_[fg] * alpha + decode_[bg] * (255 - alpha)) / 255);
+  }
+
+  // Same as Blend with fg already decoded, for colors reused across a span
+  uchar BlendLinear(int fg_lin, uchar bg, int alpha) const {
+    if (alpha <= 0) {
+      return bg;
+    }
+    if (alpha >= 255) {
+      return Encode(fg_lin);
+    }
+    return Encode((fg_lin * alpha + decode_[bg] * (255 - alpha)) / 255);
+  }
+
+ private:
+  static const int ENCODE_SHIFT = 8;
+  static const int ENCODE_SIZE = (LINEAR_ONE >> ENCODE_SHIFT) + 1;
+
+  double gamma_;
+  int decode_[256];
+  uchar encode_[ENCODE_SIZE];
+};
+
+#endif //COMPUTERGEOMETRY_GRAPHICS_CGAMMALUT_H
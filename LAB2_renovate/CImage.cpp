@@ -3,7 +3,10 @@
 //
 
 #include <map>
-#include <set>
+#include <cstring>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "CImage.h"
 #include "CImageFileOpenException.h"
@@ -12,8 +15,43 @@
 #include "CImageMemAllocException.h"
 #include "CImageFileFormatException.h"
 #include "CImageFileReadException.h"
+#include "CImageFileWriteException.h"
 
-//#define DUMP_TMP
+inline void DecodeLinear(const uchar *src, float *dst, size_t n, const CGammaLut &lut) {
+  float decode[256];
+  for (int i = 0; i < 256; i++) {
+    decode[i] = (float) lut.Decode((uchar) i) / CGammaLut::LINEAR_ONE;
+  }
+  for (size_t i = 0; i < n; i++) {
+    dst[i] = decode[src[i]];
+  }
+}
+
+// Rounds linear values to the LUT's fixed point and encodes them; the
+// scaling, clamping and conversion run four lanes at a time
+inline void EncodeLinear(const float *src, uchar *dst, size_t n, const CGammaLut &lut) {
+  const float one = (float) CGammaLut::LINEAR_ONE;
+  size_t i = 0;
+#ifdef __SSE2__
+  const __m128 scale = _mm_set1_ps(one);
+  const __m128 half = _mm_set1_ps(0.5f);
+  const __m128 lo = _mm_setzero_ps();
+  alignas(16) int lin[4];
+  for (; i + 4 <= n; i += 4) {
+    __m128 v = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(src + i), scale), half);
+    v = _mm_min_ps(_mm_max_ps(v, lo), scale);
+    _mm_store_si128((__m128i *) lin, _mm_cvttps_epi32(v));
+    dst[i] = lut.Encode(lin[0]);
+    dst[i + 1] = lut.Encode(lin[1]);
+    dst[i + 2] = lut.Encode(lin[2]);
+    dst[i + 3] = lut.Encode(lin[3]);
+  }
+#endif
+  for (; i < n; i++) {
+    float v = std::min(std::max(src[i] * one + 0.5f, 0.0f), one);
+    dst[i] = lut.Encode((int) v);
+  }
+}
 
 template<typename T>
 CImage<T>::CImage(const std::string &fname)
@@ -92,6 +130,12 @@ CImage<T>::CImage(int w, int h, int max_val, FileType type)
 template<typename T>
 T CImage<T>::GetPixel(int x, int y) const {
   if (x >= 0 && y >= 0 && x < w_ && y < h_) {
+    if (linear_lut_) {
+      T pixel;
+      EncodeLinear(&linear_[((size_t) y * w_ + x) * sizeof(T)], (uchar *) &pixel, sizeof(T),
+                   *linear_lut_);
+      return pixel;
+    }
     return data_[y * w_ + x];
   }
   return {0};
@@ -101,6 +145,10 @@ template<typename T>
 void CImage<T>::PutPixel(int x, int y, T pixel) {
   if (x >= 0 && y >= 0 && x < w_ && y < h_) {
     data_[y * w_ + x] = pixel;
+    if (linear_lut_) {
+      FillLinearRow(&linear_[((size_t) y * w_ + x) * sizeof(T)], 1, pixel, *linear_lut_);
+    }
+    MarkDirty(y, x, x);
   }
 }
 
@@ -109,6 +157,11 @@ T *CImage<T>::operator[](int i) {
   return data_ + i * w_;
 }
 
+template<typename T>
+const T *CImage<T>::operator[](int i) const {
+  return data_ + i * w_;
+}
+
 template<typename T>
 int CImage<T>::GetWidth() const {
   return w_;
@@ -126,6 +179,7 @@ int CImage<T>::GetMaxVal() const {
 
 template<typename T>
 void CImage<T>::writeImg(const std::string &fname) {
+  SyncLinear();
   FILE *f = fopen(fname.c_str(), "wb");
   if (!f) {
     int result = remove(fname.c_str());
@@ -137,11 +191,13 @@ void CImage<T>::writeImg(const std::string &fname) {
   char *head = new char[MAX_HEADER_SIZE];
   int len = snprintf(head, MAX_HEADER_SIZE, "P%i\n%i %i\n%i\n", type_, w_, h_,
                      max_val_);
-  fwrite(head, 1, len, f);
+  bool written = fwrite(head, 1, len, f) == (size_t) len;
   auto *buf = (uchar *) data_;
-  fwrite(buf, sizeof(T), w_ * h_, f);
+  written = written && fwrite(buf, sizeof(T), w_ * h_, f) == (size_t) w_ * h_;
   delete[](head);
-  fclose(f);
+  if (fclose(f) != 0 || !written) {
+    throw CImageFileWriteException();
+  }
 }
 
 template<typename T>
@@ -157,6 +213,7 @@ bool CImage<T>::FileExists(const char *s) {
 
 template<class T>
 void CImage<T>::writeImg() {
+  SyncLinear();
   FILE *f = fopen(fname_.c_str(), "wb");
   char head[MAX_HEADER_SIZE];
   int len = snprintf(head, MAX_HEADER_SIZE, "P%i\n%i %i\n%i\n", type_, w_, h_,
@@ -167,50 +224,979 @@ void CImage<T>::writeImg() {
 }
 
 template<class T>
-T apply_alpha(T bright, T under_color, int a, double gamma) {
-  double b = under_color.val / 255.0;
-  double f = bright.val / 255.0;
-  double alpha = (double) a / 255.0;
-  double out = pow(pow(f, gamma) * alpha + pow(b, gamma) * (1.0 - alpha), 1.0 / gamma);
-  return {(uchar) (255.0 * out)};
+void CImage<T>::writeImg(FILE *f) {
+  SyncLinear();
+  char head[MAX_HEADER_SIZE];
+  int len = snprintf(head, MAX_HEADER_SIZE, "P%i\n%i %i\n%i\n", type_, w_, h_,
+                     max_val_);
+  if (fwrite(head, 1, len, f) != (size_t) len
+      || fwrite(data_, sizeof(T), w_ * h_, f) != (size_t) w_ * h_) {
+    throw CImageFileWriteException();
+  }
+}
+
+template<class T>
+void CImage<T>::writeChangedRows(const std::string &fname) {
+  char head[MAX_HEADER_SIZE];
+  int len = snprintf(head, MAX_HEADER_SIZE, "P%i\n%i %i\n%i\n", type_, w_, h_,
+                     max_val_);
+  // changed_ is relative to the file written last, any other one is stale
+  FILE *f = fname == changed_fname_ ? fopen(fname.c_str(), "r+b") : nullptr;
+  if (f) {
+    char old_head[MAX_HEADER_SIZE];
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    bool same = size == len + (long) sizeof(T) * w_ * h_
+        && fread(old_head, 1, len, f) == (size_t) len && memcmp(head, old_head, len) == 0;
+    if (!same) {
+      fclose(f);
+      f = nullptr;
+    }
+  }
+  if (!f || changed_.empty()) {
+    if (f) {
+      fclose(f);
+    }
+    changed_fname_.clear();
+    writeImg(fname);
+    changed_fname_ = fname;
+    for (std::pair<int, int> &c : changed_) {
+      c = {w_, -1};
+    }
+    return;
+  }
+  SyncLinear();
+  for (int y = 0; y < h_; y++) {
+    if (changed_[y].first > changed_[y].second) {
+      continue;
+    }
+    if (fseek(f, len + (long) sizeof(T) * w_ * y, SEEK_SET) != 0
+        || fwrite(data_ + y * w_, sizeof(T), w_, f) != (size_t) w_) {
+      fclose(f);
+      changed_fname_.clear();
+      throw CImageFileWriteException();
+    }
+    changed_[y] = {w_, -1};
+  }
+  if (fclose(f) != 0) {
+    changed_fname_.clear();
+    throw CImageFileWriteException();
+  }
+}
+
+template<class T>
+void CImage<T>::TrackDirty(bool enable) {
+  dirty_.clear();
+  changed_.clear();
+  if (enable) {
+    dirty_.assign(h_, {w_, -1});
+    changed_.assign(h_, {0, w_ - 1});
+  }
+}
+
+template<class T>
+void CImage<T>::MarkDirty(int y, int x_left, int x_right) {
+  if (dirty_.empty()) {
+    return;
+  }
+  std::pair<int, int> &d = dirty_[y];
+  d.first = std::min(d.first, x_left);
+  d.second = std::max(d.second, x_right);
+  std::pair<int, int> &c = changed_[y];
+  c.first = std::min(c.first, x_left);
+  c.second = std::max(c.second, x_right);
+}
+
+template<class T>
+std::vector<DirtyRect> CImage<T>::GetDirtyRects() const {
+  // Consecutive dirty rows are merged into one rectangle
+  std::vector<DirtyRect> rects;
+  for (int y = 0; y < (int) dirty_.size(); y++) {
+    const std::pair<int, int> &d = dirty_[y];
+    if (d.first > d.second) {
+      continue;
+    }
+    if (!rects.empty() && rects.back().y_max == y) {
+      DirtyRect &r = rects.back();
+      r.x_min = std::min(r.x_min, d.first);
+      r.x_max = std::max(r.x_max, d.second + 1);
+      r.y_max = y + 1;
+    } else {
+      rects.push_back({d.first, y, d.second + 1, y + 1});
+    }
+  }
+  return rects;
+}
+
+template<class T>
+void CImage<T>::ClearDirty() {
+  for (std::pair<int, int> &d : dirty_) {
+    d = {w_, -1};
+  }
+}
+
+template<class T>
+void CImage<T>::RestoreDirty(const CImage &background) {
+  if (background.GetWidth() != w_ || background.GetHeight() != h_) {
+    throw CImageParamsException();
+  }
+  for (int y = 0; y < (int) dirty_.size(); y++) {
+    std::pair<int, int> &d = dirty_[y];
+    if (d.first > d.second) {
+      continue;
+    }
+    memcpy(data_ + y * w_ + d.first, background.data_ + y * w_ + d.first,
+           sizeof(T) * (d.second - d.first + 1));
+    if (linear_lut_) {
+      size_t first = ((size_t) y * w_ + d.first) * sizeof(T);
+      DecodeLinear((const uchar *) (data_ + y * w_ + d.first), &linear_[first],
+                   sizeof(T) * (d.second - d.first + 1), *linear_lut_);
+    }
+    std::pair<int, int> &c = changed_[y];
+    c.first = std::min(c.first, d.first);
+    c.second = std::max(c.second, d.second);
+    d = {w_, -1};
+  }
+}
+
+inline void FillRow(CMonoPixel *dst, int len, CMonoPixel color) {
+  memset(dst, color.val, len);
+}
+
+inline void FillRow(CColorPixel *dst, int len, CColorPixel color) {
+  auto *out = (uchar *) dst;
+#ifdef __SSE2__
+  if (len >= 16) {
+    // 16 pixels are exactly three 16-byte stores of the repeated pattern
+    alignas(16) uchar pattern[48];
+    for (int i = 0; i < 16; i++) {
+      pattern[3 * i] = color.r;
+      pattern[3 * i + 1] = color.g;
+      pattern[3 * i + 2] = color.b;
+    }
+    __m128i p0 = _mm_load_si128((const __m128i *) pattern);
+    __m128i p1 = _mm_load_si128((const __m128i *) (pattern + 16));
+    __m128i p2 = _mm_load_si128((const __m128i *) (pattern + 32));
+    for (; len >= 16; len -= 16, out += 48) {
+      _mm_storeu_si128((__m128i *) out, p0);
+      _mm_storeu_si128((__m128i *) (out + 16), p1);
+      _mm_storeu_si128((__m128i *) (out + 32), p2);
+    }
+  }
+#endif
+  for (; len > 0; len--, out += 3) {
+    out[0] = color.r;
+    out[1] = color.g;
+    out[2] = color.b;
+  }
+}
+
+// Length of the run of fully covered pixels at the start of coverage
+inline int SolidRun(const uchar *coverage, int len) {
+  int n = 0;
+#ifdef __SSE2__
+  const __m128i full = _mm_set1_epi8((char) 0xFF);
+  for (; n + 16 <= len; n += 16) {
+    __m128i c = _mm_loadu_si128((const __m128i *) (coverage + n));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(c, full)) != 0xFFFF) {
+      break;
+    }
+  }
+#endif
+  while (n < len && coverage[n] == 255) {
+    n++;
+  }
+  return n;
+}
+
+inline void BlendValue(CMonoPixel &dst, CMonoPixel color, int alpha, const CGammaLut &lut) {
+  dst.val = lut.Blend(color.val, dst.val, alpha);
+}
+
+inline void BlendValue(CColorPixel &dst, CColorPixel color, int alpha, const CGammaLut &lut) {
+  dst.r = lut.Blend(color.r, dst.r, alpha);
+  dst.g = lut.Blend(color.g, dst.g, alpha);
+  dst.b = lut.Blend(color.b, dst.b, alpha);
+}
+
+// Solid runs are stored with FillRow, partial coverage goes through the LUT
+// with the color decoded once per span
+inline void BlendRow(CMonoPixel *dst, int len, const uchar *coverage, CMonoPixel color,
+                     const CGammaLut &lut) {
+  int fg = lut.Decode(color.val);
+  int i = 0;
+  while (i < len) {
+    int run = SolidRun(coverage + i, len - i);
+    if (run) {
+      FillRow(dst + i, run, color);
+      i += run;
+      continue;
+    }
+    if (coverage[i]) {
+      dst[i].val = lut.BlendLinear(fg, dst[i].val, coverage[i]);
+    }
+    i++;
+  }
+}
+
+inline void BlendRow(CColorPixel *dst, int len, const uchar *coverage, CColorPixel color,
+                     const CGammaLut &lut) {
+  int fg_r = lut.Decode(color.r);
+  int fg_g = lut.Decode(color.g);
+  int fg_b = lut.Decode(color.b);
+  int i = 0;
+  while (i < len) {
+    int run = SolidRun(coverage + i, len - i);
+    if (run) {
+      FillRow(dst + i, run, color);
+      i += run;
+      continue;
+    }
+    int a = coverage[i];
+    if (a) {
+      dst[i].r = lut.BlendLinear(fg_r, dst[i].r, a);
+      dst[i].g = lut.BlendLinear(fg_g, dst[i].g, a);
+      dst[i].b = lut.BlendLinear(fg_b, dst[i].b, a);
+    }
+    i++;
+  }
+}
+
+// Linear canvas counterparts of BlendRow and FillRow; pixels are sizeof(P)
+// consecutive floats, one per channel
+template<class P>
+inline void BlendLinearRow(float *dst, int len, const uchar *coverage, P color,
+                           const CGammaLut &lut) {
+  const int channels = sizeof(P);
+  const uchar *src = (const uchar *) &color;
+  float fg[channels];
+  for (int c = 0; c < channels; c++) {
+    fg[c] = (float) lut.Decode(src[c]) / CGammaLut::LINEAR_ONE;
+  }
+  for (int i = 0; i < len; i++, dst += channels) {
+    int a = coverage[i];
+    if (a == 255) {
+      for (int c = 0; c < channels; c++) {
+        dst[c] = fg[c];
+      }
+    } else if (a) {
+      float k = a * (1.0f / 255);
+      for (int c = 0; c < channels; c++) {
+        dst[c] += (fg[c] - dst[c]) * k;
+      }
+    }
+  }
+}
+
+template<class P>
+inline void FillLinearRow(float *dst, int len, P color, const CGammaLut &lut) {
+  const int channels = sizeof(P);
+  const uchar *src = (const uchar *) &color;
+  float fg[channels];
+  for (int c = 0; c < channels; c++) {
+    fg[c] = (float) lut.Decode(src[c]) / CGammaLut::LINEAR_ONE;
+  }
+  for (int i = 0; i < len; i++, dst += channels) {
+    for (int c = 0; c < channels; c++) {
+      dst[c] = fg[c];
+    }
+  }
+}
+
+// Coverage of pixels px0 .. px0 + len - 1 in row py by a capsule of half
+// width hw around the segment a + t * d: the overlap of the pixel's unit
+// interval across the stroke with [-hw, hw] at the pixel's distance
+inline void CapsuleCoverage(float px0, float py, int len, float ax, float ay, float dx, float dy,
+                            float hw, uchar *alpha) {
+  float len2 = dx * dx + dy * dy;
+  float inv = len2 > 0 ? 1 / len2 : 0;
+  float ry = py - ay;
+  int i = 0;
+#ifdef __SSE2__
+  const __m128 zero = _mm_setzero_ps();
+  const __m128 one = _mm_set1_ps(1.0f);
+  const __m128 half = _mm_set1_ps(0.5f);
+  const __m128 scale = _mm_set1_ps(255.0f);
+  const __m128 v_hw = _mm_set1_ps(hw);
+  const __m128 v_dx = _mm_set1_ps(dx);
+  const __m128 v_dy = _mm_set1_ps(dy);
+  const __m128 v_inv = _mm_set1_ps(inv);
+  const __m128 v_ry = _mm_set1_ps(ry);
+  const __m128 ry_dy = _mm_set1_ps(ry * dy);
+  const __m128 step = _mm_set_ps(3, 2, 1, 0);
+  auto lanes = [&](float x) {
+    __m128 rx = _mm_add_ps(_mm_set1_ps(x - ax), step);
+    __m128 t = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(rx, v_dx), ry_dy), v_inv);
+    t = _mm_min_ps(_mm_max_ps(t, zero), one);
+    __m128 qx = _mm_sub_ps(rx, _mm_mul_ps(t, v_dx));
+    __m128 qy = _mm_sub_ps(v_ry, _mm_mul_ps(t, v_dy));
+    __m128 d = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(qx, qx), _mm_mul_ps(qy, qy)));
+    __m128 hi = _mm_min_ps(_mm_add_ps(d, half), v_hw);
+    __m128 lo = _mm_max_ps(_mm_sub_ps(d, half), _mm_sub_ps(zero, v_hw));
+    __m128 cov = _mm_min_ps(_mm_max_ps(_mm_sub_ps(hi, lo), zero), one);
+    return _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(cov, scale), half));
+  };
+  // Eight pixels per iteration, packed down to bytes in registers
+  for (; i + 8 <= len; i += 8) {
+    __m128i a = lanes(px0 + i);
+    __m128i b = lanes(px0 + i + 4);
+    __m128i packed = _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_setzero_si128());
+    _mm_storel_epi64((__m128i *) (alpha + i), packed);
+  }
+#endif
+  for (; i < len; i++) {
+    float rx = px0 + i - ax;
+    float t = std::min(std::max((rx * dx + ry * dy) * inv, 0.0f), 1.0f);
+    float qx = rx - t * dx;
+    float qy = ry - t * dy;
+    float d = std::sqrt(qx * qx + qy * qy);
+    float cov = std::min(d + 0.5f, hw) - std::max(d - 0.5f, -hw);
+    cov = std::min(std::max(cov, 0.0f), 1.0f);
+    alpha[i] = (uchar) (cov * 255 + 0.5f);
+  }
+}
+
+struct ChordEdge {
+  double y_min, y_max;
+  double x0, y0;
+  double dxdy;
+};
+
+// Horizontal edges are left out, the edges next to them end at the same
+// points
+inline std::vector<ChordEdge> ChordEdges(const std::vector<std::pair<double, double>> &points) {
+  std::vector<ChordEdge> edges;
+  size_t n = points.size();
+  for (size_t i = 0; i < n; i++) {
+    const std::pair<double, double> &a = points[i];
+    const std::pair<double, double> &b = points[(i + 1) % n];
+    if (a.second != b.second) {
+      edges.push_back({std::min(a.second, b.second), std::max(a.second, b.second), a.first,
+                       a.second, (b.first - a.first) / (b.second - a.second)});
+    }
+  }
+  return edges;
+}
+
+// Horizontal chord [left, right] of a convex polygon at height y
+inline bool ConvexChord(const std::vector<ChordEdge> &edges, double y, double &left,
+                        double &right) {
+  left = DBL_MAX;
+  right = -DBL_MAX;
+  for (const ChordEdge &e : edges) {
+    if (y >= e.y_min && y <= e.y_max) {
+      double x = e.x0 + (y - e.y0) * e.dxdy;
+      left = std::min(left, x);
+      right = std::max(right, x);
+    }
+  }
+  return left <= right;
+}
+
+// Number of the rate sample columns of pixel px, at px + (i + 0.5) / rate,
+// that fall inside [left, right)
+inline int ChordSamples(double left, double right, int px, int rate) {
+  int lo = (int) std::ceil((left - px) * rate - 0.5);
+  int hi = (int) std::ceil((right - px) * rate - 0.5);
+  return std::max(std::min(hi, rate) - std::max(lo, 0), 0);
+}
+
+template<class P>
+P GrayPixel(uchar val);
+
+template<>
+inline CMonoPixel GrayPixel<CMonoPixel>(uchar val) {
+  return {val};
+}
+
+template<>
+inline CColorPixel GrayPixel<CColorPixel>(uchar val) {
+  return {val, val, val};
+}
+
+// Color of a drawLines stroke on an image of pixel type P
+template<class P>
+P SpecPixel(CMonoPixel color) {
+  return GrayPixel<P>(color.val);
+}
+
+template<class P>
+P SpecPixel(CColorPixel color);
+
+template<>
+inline CColorPixel SpecPixel<CColorPixel>(CColorPixel color) {
+  return color;
+}
+
+inline int PixelKey(CMonoPixel pix) {
+  return pix.val;
+}
+
+inline int PixelKey(CColorPixel pix) {
+  return pix.r << 16 | pix.g << 8 | pix.b;
+}
+
+inline CMonoPixel ScalePixel(CMonoPixel pix, double k) {
+  pix.val *= k;
+  return pix;
+}
+
+inline CColorPixel ScalePixel(CColorPixel pix, double k) {
+  pix.r *= k;
+  pix.g *= k;
+  pix.b *= k;
+  return pix;
+}
+
+template<class T>
+void CImage<T>::BlendSpan(int y, int x, int len, const uchar *coverage, T color,
+                          const CGammaLut &lut) {
+  if (y < 0 || y >= h_) {
+    return;
+  }
+  if (x < 0) {
+    coverage -= x;
+    len += x;
+    x = 0;
+  }
+  len = std::min(len, w_ - x);
+  if (len > 0) {
+    CompositeRow(y, x, len, coverage, color, lut);
+    MarkDirty(y, x, x + len - 1);
+  }
+}
+
+template<class T>
+void CImage<T>::CompositeRow(int y, int x, int len, const uchar *coverage, T color,
+                             const CGammaLut &lut) {
+  if (linear_lut_) {
+    BlendLinearRow(&linear_[((size_t) y * w_ + x) * sizeof(T)], len, coverage, color,
+                   *linear_lut_);
+  } else {
+    BlendRow(data_ + y * w_ + x, len, coverage, color, lut);
+  }
+}
+
+template<class T>
+void CImage<T>::BeginLinear(double gamma) {
+  EndLinear();
+  linear_lut_ = &CGammaLut::Get(gamma);
+  linear_.resize((size_t) w_ * h_ * sizeof(T));
+  DecodeLinear((const uchar *) data_, linear_.data(), linear_.size(), *linear_lut_);
+}
+
+template<class T>
+void CImage<T>::SyncLinear() {
+  if (linear_lut_) {
+    EncodeLinear(linear_.data(), (uchar *) data_, linear_.size(), *linear_lut_);
+  }
+}
+
+template<class T>
+void CImage<T>::EndLinear() {
+  if (!linear_lut_) {
+    return;
+  }
+  SyncLinear();
+  linear_lut_ = nullptr;
+  linear_.clear();
+  linear_.shrink_to_fit();
 }
 
 template<class T>
 void
 CImage<T>::drawLine(uchar bright, double thickness, double x1, double y1,
-                    double x2, double y2, double gamma) {
-  if (thickness > 1) {
-    int scale_x = 4;
-    int scale_y = 4;
+                    double x2, double y2, double gamma, StrokeMethod method) {
+  drawLine(GrayPixel<T>(bright), thickness, x1, y1, x2, y2, gamma, method);
+}
 
+template<class T>
+void
+CImage<T>::drawLine(T color, double thickness, double x1, double y1,
+                    double x2, double y2, double gamma, StrokeMethod method) {
+  if (method == DISTANCE_STROKE) {
+    DrawDistanceLine(color, thickness, x1, y1, x2, y2, gamma);
+    return;
+  }
+  if (thickness > 1 && mask_cache_ && DrawCachedLine(color, thickness, x1, y1, x2, y2, gamma)) {
+    return;
+  }
+  if (thickness > 1) {
     std::vector<std::pair<double, double>>
-        points = CalculateLineBorderPoints(
-        thickness, x1, y1, x2, y2);
+        points = StrokeOutline(thickness, x1, y1, x2, y2);
+    if (points.empty()) {
+      return;
+    }
+    const CGammaLut &lut = CGammaLut::Get(gamma);
+    RasterizeConvex(points, 0, 0, w_, h_, [&](int y, int x, int len, const uchar *alpha) {
+      BlendSpan(y, x, len, alpha, color, lut);
+    });
+  } else {
+    DrawWuLineFixed(color, thickness, x1, y1, x2, y2, gamma);
+  }
+}
+
+template<class T>
+void CImage<T>::drawText(const CFont &font, const std::string &text, int x, int y, uchar bright,
+                         double gamma, int scale) {
+  drawText(font, text, x, y, GrayPixel<T>(bright), gamma, scale);
+}
+
+template<class T>
+void CImage<T>::drawText(const CFont &font, const std::string &text, int x, int y, T color,
+                         double gamma, int scale) {
+  const CGammaLut &lut = CGammaLut::Get(gamma);
+  scale = std::max(scale, 1);
+  std::vector<uchar> scaled;
+  int pen_x = x;
+  int pen_y = y;
+  for (char c : text) {
+    if (c == '\n') {
+      pen_x = x;
+      pen_y += font.GetLineHeight() * scale;
+      continue;
+    }
+    const CFont::Glyph *glyph = font.GetGlyph((uchar) c);
+    if (!glyph) {
+      continue;
+    }
+    int left = pen_x + glyph->left * scale;
+    int top = pen_y + glyph->top * scale;
+    int len = glyph->w * scale;
+    for (int row = 0; row < glyph->h; row++) {
+      const uchar *alpha = font.GetRow(*glyph, row);
+      if (scale > 1) {
+        scaled.resize(len);
+        for (int i = 0; i < len; i++) {
+          scaled[i] = alpha[i / scale];
+        }
+        alpha = scaled.data();
+      }
+      for (int k = 0; k < scale; k++) {
+        BlendSpan(top + row * scale + k, left, len, alpha, color, lut);
+      }
+    }
+    pen_x += glyph->advance * scale;
+  }
+}
+
+template<class T>
+void CImage<T>::SetMaskCache(CCoverageMaskCache *cache) {
+  mask_cache_ = cache;
+}
+
+template<class T>
+void CImage<T>::SetEdgeSampling(int rate) {
+  edge_samples_ = std::min(std::max(rate, 4), 16);
+}
+
+// Each pixel row is split by the outline into exterior, edge and interior
+// pixels. The outline being convex, its left border is a convex function of
+// y and the right one a concave one, so the pixels covered over the whole row
+// lie between the chords at the row's top and bottom; they go in as a single
+// run and only the pixels left over on either side are sampled.
+template<class T>
+template<class RowFn>
+void CImage<T>::RasterizeConvex(const std::vector<std::pair<double, double>> &points, int x_min,
+                                int y_min, int x_max, int y_max, RowFn fn) {
+  if (points.size() < 3) {
+    return;
+  }
+  double top = DBL_MAX;
+  double bottom = -DBL_MAX;
+  double left = DBL_MAX;
+  double right = -DBL_MAX;
+  for (const std::pair<double, double> &p : points) {
+    top = std::min(top, p.second);
+    bottom = std::max(bottom, p.second);
+    left = std::min(left, p.first);
+    right = std::max(right, p.first);
+  }
+  x_min = std::max(x_min, (int) floor(left));
+  x_max = std::min(x_max, (int) ceil(right));
+  y_min = std::max(y_min, (int) floor(top));
+  y_max = std::min(y_max, (int) ceil(bottom));
+  if (x_min >= x_max || y_min >= y_max) {
+    return;
+  }
+
+  int rate = edge_samples_;
+  std::vector<ChordEdge> edges = ChordEdges(points);
+  CSparseCoverage coverage((x_max - x_min) * rate, (y_max - y_min) * rate, rate, rate);
+  std::vector<int> samples;
+  for (int y = y_min; y < y_max; y++) {
+    double l0, r0, l1, r1;
+    bool has_top = ConvexChord(edges, y, l0, r0);
+    bool has_bottom = ConvexChord(edges, y + 1, l1, r1);
+    double out_l = DBL_MAX;
+    double out_r = -DBL_MAX;
+    if (has_top) {
+      out_l = l0;
+      out_r = r0;
+    }
+    if (has_bottom) {
+      out_l = std::min(out_l, l1);
+      out_r = std::max(out_r, r1);
+    }
+    for (const std::pair<double, double> &p : points) {
+      if (p.second > y && p.second < y + 1) {
+        out_l = std::min(out_l, p.first);
+        out_r = std::max(out_r, p.first);
+      }
+    }
+    int px_first = std::max((int) floor(out_l), x_min);
+    int px_last = std::min((int) ceil(out_r) - 1, x_max - 1);
+    if (px_first > px_last) {
+      continue;
+    }
+    int in_first = px_last + 1;
+    int in_last = px_last;
+    if (has_top && has_bottom && top <= y && bottom >= y + 1) {
+      in_first = std::max((int) ceil(std::max(l0, l1)), px_first);
+      in_last = std::min((int) floor(std::min(r0, r1)) - 1, px_last);
+      if (in_first > in_last) {
+        in_first = px_last + 1;
+        in_last = px_last;
+      }
+    }
+
+    // Edge pixels are [px_first, in_first) and (in_last, px_last]
+    samples.assign(px_last - px_first + 1, 0);
+    for (int j = 0; j < rate; j++) {
+      double l, r;
+      if (!ConvexChord(edges, y + (j + 0.5) / rate, l, r)) {
+        continue;
+      }
+      int from = std::max((int) floor(l), px_first);
+      int to = std::min((int) ceil(r) - 1, px_last);
+      for (int px = from; px <= to && px < in_first; px++) {
+        samples[px - px_first] += ChordSamples(l, r, px, rate);
+      }
+      for (int px = std::max(from, in_last + 1); px <= to; px++) {
+        samples[px - px_first] += ChordSamples(l, r, px, rate);
+      }
+    }
+    int row = y - y_min;
+    for (int px = px_first; px < in_first; px++) {
+      coverage.AddCover(row, px - x_min, samples[px - px_first]);
+    }
+    coverage.AddRun(row, in_first - x_min, in_last + 1 - x_min);
+    for (int px = in_last + 1; px <= px_last; px++) {
+      coverage.AddCover(row, px - x_min, samples[px - px_first]);
+    }
+  }
+  coverage.Resolve([&](int row, int x, int len, const uchar *alpha) {
+    fn(y_min + row, x_min + x, len, alpha);
+  });
+}
+
+template<class T>
+bool CImage<T>::DrawCachedLine(T color, double thickness, double x1, double y1, double x2,
+                               double y2, double gamma) {
+  const int geometry = CCoverageMaskCache::GEOMETRY_STEPS;
+  const int subpixel = CCoverageMaskCache::SUBPIXEL_STEPS;
+  const double max_mask_area = 1 << 20;
+  double extent_x = std::abs(x2 - x1) + thickness + 4;
+  double extent_y = std::abs(y2 - y1) + thickness + 4;
+  if (!(extent_x * extent_y <= max_mask_area)) {
+    return false;
+  }
+
+  // The stroke is snapped to the key's grid, so a hit and a miss draw the
+  // very same pixels
+  CCoverageMaskCache::Key key;
+  double base_x = floor(x1);
+  double base_y = floor(y1);
+  key.fx = (int) std::lround((x1 - base_x) * subpixel);
+  key.fy = (int) std::lround((y1 - base_y) * subpixel);
+  if (key.fx == subpixel) {
+    key.fx = 0;
+    base_x++;
+  }
+  if (key.fy == subpixel) {
+    key.fy = 0;
+    base_y++;
+  }
+  key.dx = (int) std::lround((x2 - x1) * geometry);
+  key.dy = (int) std::lround((y2 - y1) * geometry);
+  key.thickness = (int) std::lround(thickness * geometry);
+  key.samples = edge_samples_;
+  if (key.dx == 0 && key.dy == 0) {
+    return true;
+  }
+  // Off-canvas strokes are left to the clipping path
+  if (base_x - extent_x > w_ || base_x + extent_x < 0 || base_y - extent_y > h_
+      || base_y + extent_y < 0) {
+    return false;
+  }
+
+  std::shared_ptr<const CCoverageMaskCache::Mask> mask = mask_cache_->Find(key);
+  if (!mask) {
+    double lx1 = (double) key.fx / subpixel;
+    double ly1 = (double) key.fy / subpixel;
+    std::vector<std::pair<double, double>> points =
+        CalculateLineBorderPoints((double) key.thickness / geometry, lx1, ly1,
+                                  lx1 + (double) key.dx / geometry, ly1 + (double) key.dy / geometry);
     std::pair<double, double> upper_corner = GetUpperCorner(points);
+    double x_max = upper_corner.first;
+    double y_max = upper_corner.second;
+    for (const std::pair<double, double> &p : points) {
+      x_max = std::max(x_max, p.first);
+      y_max = std::max(y_max, p.second);
+    }
 
-    ScaleBorderPoints(points, scale_x, scale_y);
+    std::shared_ptr<CCoverageMaskCache::Mask> built = std::make_shared<CCoverageMaskCache::Mask>();
+    built->x0 = (int) upper_corner.first;
+    built->y0 = (int) upper_corner.second;
+    built->w = (int) ceil(x_max) - built->x0;
+    built->h = (int) ceil(y_max) - built->y0;
+    built->alpha.assign((size_t) built->w * built->h, 0);
+    RasterizeConvex(points, built->x0, built->y0, built->x0 + built->w, built->y0 + built->h,
+                    [&](int y, int x, int len, const uchar *alpha) {
+                      std::copy(alpha, alpha + len,
+                                &built->alpha[(size_t) (y - built->y0) * built->w + x - built->x0]);
+                    });
+    mask_cache_->Insert(key, built);
+    mask = built;
+  }
+
+  const CGammaLut &lut = CGammaLut::Get(gamma);
+  int x = (int) base_x + mask->x0;
+  int y = (int) base_y + mask->y0;
+  for (int j = 0; j < mask->h; j++) {
+    BlendSpan(y + j, x, mask->w, &mask->alpha[(size_t) j * mask->w], color, lut);
+  }
+  return true;
+}
 
-    CImage<T>::Polygon polygon;
-    polygon.GroupAdd(points);
-    polygon.close();
+template<class T>
+template<class P>
+void CImage<T>::drawLines(const std::vector<CLineSpec<P>> &lines, double gamma, int threads) {
+  if (threads <= 0) {
+    threads = CThreadPool::DefaultThreadCount();
+  }
+  if (!pool_ || pool_->GetThreadCount() != threads) {
+    pool_.reset(new CThreadPool(threads));
+  }
+  drawLines(lines, gamma, *pool_);
+}
 
-    std::pair<double, double>
-        bounds = GetScaledBounds(points, scale_x, scale_y);
+template<class T>
+template<class P>
+void CImage<T>::drawLines(const std::vector<CLineSpec<P>> &lines, double gamma, CThreadPool &pool) {
+  const CGammaLut &lut = CGammaLut::Get(gamma);
+  const int tile = TILE_SIZE;
+  const int chunk = 256;
+  int n = (int) lines.size();
+
+  // Strokes of one color are filled as a union, so every covered pixel is
+  // blended once per color no matter how many lines overlap it. Groups are
+  // composited in the order their color first appears.
+  std::vector<int> group(n);
+  std::vector<T> group_color;
+  std::map<int, int> group_of;
+  for (int i = 0; i < n; i++) {
+    T color = SpecPixel<T>(lines[i].color);
+    auto found = group_of.insert({PixelKey(color), (int) group_color.size()});
+    if (found.second) {
+      group_color.push_back(color);
+    }
+    group[i] = found.first->second;
+  }
 
-    CImage<CMonoPixel>
-        tmp = CImage(bounds.first, bounds.second, GetMaxVal(), P5);
+  std::vector<std::vector<std::pair<double, double>>> outlines(n);
+  pool.ParallelFor((n + chunk - 1) / chunk, [&](int c) {
+    for (int i = c * chunk; i < n && i < (c + 1) * chunk; i++) {
+      const CLineSpec<P> &line = lines[i];
+      if (line.thickness > 1) {
+        outlines[i] = StrokeOutline(line.thickness, line.x1, line.y1, line.x2, line.y2);
+      }
+    }
+  });
+
+  // Bin every outline into the tiles it actually crosses, one tile row at a
+  // time; bins end up ordered by (group, line index), which fixes the
+  // compositing order
+  std::vector<int> order(n);
+  for (int i = 0; i < n; i++) {
+    order[i] = i;
+  }
+  std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+    return group[a] < group[b];
+  });
+  int tiles_x = (w_ + tile - 1) / tile;
+  int tiles_y = (h_ + tile - 1) / tile;
+  std::vector<std::vector<int>> bins(tiles_x * tiles_y);
+  for (int i : order) {
+    const std::vector<std::pair<double, double>> &outline = outlines[i];
+    if (outline.empty()) {
+      continue;
+    }
+    std::pair<double, double> corner = GetUpperCorner(outline);
+    double y_max = corner.second;
+    for (const std::pair<double, double> &p : outline) {
+      y_max = std::max(y_max, p.second);
+    }
+    int ty0 = std::max((int) corner.second, 0) / tile;
+    int ty1 = std::min((int) y_max, h_ - 1) / tile;
+    for (int ty = ty0; ty <= ty1; ty++) {
+      std::vector<std::pair<double, double>> band = ClipPolygon(outline, -1, ty * tile, w_ + 1, (ty + 1) * tile);
+      if (band.empty()) {
+        continue;
+      }
+      double x_min = band[0].first;
+      double x_max = band[0].first;
+      for (const std::pair<double, double> &p : band) {
+        x_min = std::min(x_min, p.first);
+        x_max = std::max(x_max, p.first);
+      }
+      int tx0 = std::max((int) x_min, 0) / tile;
+      int tx1 = std::min((int) x_max, w_ - 1) / tile;
+      for (int tx = tx0; tx <= tx1; tx++) {
+        bins[ty * tiles_x + tx].push_back(i);
+      }
+    }
+  }
 
-    FillPolygon(polygon, tmp, {255});
+  // Each tile owns its pixels, so workers composite without locking; the
+  // touched area of every tile is marked dirty afterwards
+  std::vector<DirtyRect> touched(tiles_x * tiles_y, DirtyRect{w_, h_, 0, 0});
+  pool.ParallelFor(tiles_x * tiles_y, [&](int t) {
+    const std::vector<int> &bin = bins[t];
+    if (bin.empty()) {
+      return;
+    }
+    int x0 = (t % tiles_x) * tile;
+    int y0 = (t / tiles_x) * tile;
+    CScanlineRasterizer rasterizer(w_, h_);
+    rasterizer.SetClipBox(x0, y0, std::min(x0 + tile, w_), std::min(y0 + tile, h_));
+    size_t k = 0;
+    while (k < bin.size()) {
+      int g = group[bin[k]];
+      T color = group_color[g];
+      rasterizer.Reset();
+      while (k < bin.size() && group[bin[k]] == g) {
+        rasterizer.AddContour(outlines[bin[k++]]);
+      }
+      DirtyRect &r = touched[t];
+      rasterizer.Sweep([&](int y, int x, int len, const uchar *coverage) {
+        CompositeRow(y, x, len, coverage, color, lut);
+        r = {std::min(r.x_min, x), std::min(r.y_min, y), std::max(r.x_max, x + len),
+             std::max(r.y_max, y + 1)};
+      });
+    }
+  });
+  for (const DirtyRect &r : touched) {
+    for (int y = r.y_min; y < r.y_max; y++) {
+      MarkDirty(y, r.x_min, r.x_max - 1);
+    }
+  }
 
-#ifdef DUMP_TMP
-    tmp.writeImg("tmp.pgm");
-#endif
-    DrawDownscaled(tmp, scale_x, scale_y, upper_corner, {bright}, gamma);
-  } else {
-    DrawWuLine({bright}, thickness, x1, y1, x2, y2, gamma);
+  // Hairlines look exactly as drawLine draws them, on top of the strokes
+  for (const CLineSpec<P> &line : lines) {
+    if (line.thickness > 0 && line.thickness <= 1) {
+      DrawWuLineFixed(SpecPixel<T>(line.color), line.thickness, line.x1, line.y1, line.x2,
+                      line.y2, gamma);
+    }
   }
 }
 
+template<class T>
+void CImage<T>::drawPath(const CPath &path, uchar bright, double thickness, LineJoin join,
+                         LineCap cap, double gamma) {
+  drawPath(path, GrayPixel<T>(bright), thickness, join, cap, gamma);
+}
+
+template<class T>
+void CImage<T>::drawPath(const CPath &path, T color, double thickness, LineJoin join,
+                         LineCap cap, double gamma) {
+  const CGammaLut &lut = CGammaLut::Get(gamma);
+  CStroker stroker(thickness, join, cap);
+  CScanlineRasterizer rasterizer(w_, h_);
+  for (std::vector<std::pair<double, double>> &contour : stroker.Stroke(path)) {
+    // Same convention as drawLine: integer coordinates are pixel centers
+    ShiftPoints(contour, 0.5, 0.5);
+    rasterizer.AddContour(contour);
+  }
+  rasterizer.Sweep([&](int y, int x, int len, const uchar *coverage) {
+    BlendSpan(y, x, len, coverage, color, lut);
+  });
+}
+
+template<class T>
+void CImage<T>::fillPolygons(const std::vector<std::vector<std::pair<double, double>>> &contours,
+                             uchar bright, FillRule rule, double gamma) {
+  fillPolygons(contours, GrayPixel<T>(bright), rule, gamma);
+}
+
+template<class T>
+void CImage<T>::fillPolygons(const std::vector<std::vector<std::pair<double, double>>> &contours,
+                             T color, FillRule rule, double gamma) {
+  const CGammaLut &lut = CGammaLut::Get(gamma);
+  CScanlineRasterizer rasterizer(w_, h_);
+  rasterizer.SetFillRule(rule);
+  for (const std::vector<std::pair<double, double>> &contour : contours) {
+    rasterizer.AddContour(contour);
+  }
+  rasterizer.Sweep([&](int y, int x, int len, const uchar *coverage) {
+    BlendSpan(y, x, len, coverage, color, lut);
+  });
+}
+
+template<class T>
+void CImage<T>::drawPolyline(const std::vector<std::pair<double, double>> &points, uchar bright,
+                             double thickness, LineJoin join, LineCap cap, double gamma) {
+  drawPolyline(points, GrayPixel<T>(bright), thickness, join, cap, gamma);
+}
+
+template<class T>
+void CImage<T>::drawPolyline(const std::vector<std::pair<double, double>> &points, T color,
+                             double thickness, LineJoin join, LineCap cap, double gamma) {
+  // The segments are offset by thickness / 2 along their normals exactly as
+  // in CalculateLineBorderPoints (SQUARE_CAP gives drawLine's ends), but the
+  // whole polyline is one outline, so joints are blended only once
+  if (points.empty()) {
+    return;
+  }
+  CPath path;
+  path.MoveTo(points[0].first, points[0].second);
+  for (size_t i = 1; i < points.size(); i++) {
+    path.LineTo(points[i].first, points[i].second);
+  }
+  drawPath(path, color, thickness, join, cap, gamma);
+}
+
+template<class T>
+std::vector<std::pair<double, double>>
+CImage<T>::StrokeOutline(double thickness, double x1, double y1, double x2,
+                         double y2) {
+  if (x1 == x2 && y1 == y2) {
+    return {};
+  }
+  // Cut the segment down to the part that can reach the canvas; the caps
+  // of a shortened segment then land outside the margin
+  double margin = thickness + 2;
+  double t0, t1;
+  if (!ClipSegment(x1, y1, x2, y2, -margin, -margin, w_ + margin, h_ + margin, t0, t1) || t0 == t1) {
+    return {};
+  }
+  double dx = x2 - x1;
+  double dy = y2 - y1;
+  x2 = x1 + t1 * dx;
+  y2 = y1 + t1 * dy;
+  x1 += t0 * dx;
+  y1 += t0 * dy;
+
+  std::vector<std::pair<double, double>>
+      points = ClipPolygon(CalculateLineBorderPoints(thickness, x1, y1, x2, y2),
+                           -1, -1, w_ + 1, h_ + 1);
+  if (points.size() < 4) {
+    return {};
+  }
+  return points;
+}
+
 template<class T>
 std::vector<std::pair<double, double>>
 CImage<T>::CalculateLineBorderPoints(double thickness, double x1, double y1,
@@ -270,119 +1256,186 @@ CImage<T>::CalculateLineBorderPoints(double thickness, double x1, double y1,
 
 template<class T>
 CImage<T>::CImage(const CImage<T> &img)
-    : w_(img.GetWidth()), h_(img.GetHeight()), max_val_(img.GetMaxVal()) {
+    : fname_(img.fname_), type_(img.type_), w_(img.GetWidth()), h_(img.GetHeight()),
+      max_val_(img.GetMaxVal()) {
   data_ = new T[w_ * h_];
+  if (img.linear_lut_) {
+    EncodeLinear(img.linear_.data(), (uchar *) data_, img.linear_.size(), *img.linear_lut_);
+    return;
+  }
   for (int i = 0; i < w_ * h_; i++) {
     data_[i] = img.data_[i];
   }
 }
 
 template<class T>
-void
-CImage<T>::ScaleBorderPoints(std::vector<std::pair<double, double>> &points,
-                             int scale_x, int scale_y) {
+std::pair<double, double> CImage<T>::GetUpperCorner(
+    const std::vector<std::pair<double, double>> &points) {
   double x_min = INT32_MAX;
   double y_min = INT32_MAX;
-  double x_max = INT32_MIN;
-  double y_max = INT32_MIN;
   for (std::pair<double, double> p : points) {
     x_min = std::min(x_min, p.first);
-    x_max = std::max(x_max, p.first);
     y_min = std::min(y_min, p.second);
-    y_max = std::max(y_max, p.second);
-  }
-
-  for (std::pair<double, double> &p : points) {
-    p.first -= floor(x_min);
-    p.second -= floor(y_min);
-    p.first = p.first * scale_x;
-    p.second = (p.second * scale_y);
   }
+  return std::make_pair(floor(x_min), floor(y_min));
 }
 
 template<class T>
-std::pair<double, double> CImage<T>::GetScaledBounds(
-    const std::vector<std::pair<double, double>> &points,
-    int scale_x,
-    int scale_y) {
-  double x_min = INT32_MAX;
-  double y_min = INT32_MAX;
-  double x_max = INT32_MIN;
-  double y_max = INT32_MIN;
-  for (std::pair<double, double> p : points) {
-    x_min = floor(std::min(x_min, p.first));
-    x_max = ceil(std::max(x_max, p.first));
-    y_min = floor(std::min(y_min, p.second));
-    y_max = ceil(std::max(y_max, p.second));
+void CImage<T>::BlendPixel(int x, int y, T color, int alpha, const CGammaLut &lut) {
+  if (x >= 0 && y >= 0 && x < w_ && y < h_) {
+    if (linear_lut_) {
+      uchar coverage = (uchar) std::min(std::max(alpha, 0), 255);
+      CompositeRow(y, x, 1, &coverage, color, lut);
+    } else {
+      BlendValue(data_[y * w_ + x], color, alpha, lut);
+    }
+    MarkDirty(y, x, x);
   }
-  return std::make_pair(x_max - x_min, y_max - y_min);
 }
 
 template<class T>
-std::pair<double, double> CImage<T>::GetUpperCorner(
-    const std::vector<std::pair<double, double>> &points) {
-  double x_min = INT32_MAX;
-  double y_min = INT32_MAX;
-  for (std::pair<double, double> p : points) {
-    x_min = std::min(x_min, p.first);
-    y_min = std::min(y_min, p.second);
+bool CImage<T>::ClipSegment(double x1, double y1, double x2, double y2, double x_min,
+                            double y_min, double x_max, double y_max, double &t0, double &t1) {
+  // Liang-Barsky: returns the parameter range [t0, t1] of the segment inside the box
+  double dx = x2 - x1;
+  double dy = y2 - y1;
+  double p[4] = {-dx, dx, -dy, dy};
+  double q[4] = {x1 - x_min, x_max - x1, y1 - y_min, y_max - y1};
+  t0 = 0.0;
+  t1 = 1.0;
+  for (int i = 0; i < 4; i++) {
+    if (p[i] == 0.0) {
+      if (q[i] < 0.0) {
+        return false;
+      }
+    } else {
+      double t = q[i] / p[i];
+      if (p[i] < 0.0) {
+        t0 = std::max(t0, t);
+      } else {
+        t1 = std::min(t1, t);
+      }
+    }
   }
-  return std::make_pair(floor(x_min), floor(y_min));
+  return t0 <= t1;
 }
 
 template<class T>
-void
-CImage<T>::DrawDownscaled(const CImage<CMonoPixel> &img, int scale_x,
-                          int scale_y,
-                          const std::pair<double, double> &start_coord,
-                          T bright,
-                          double gamma) {
-  int alpha_val = 0;
-  int y;
-  int x;
-  for (y = 0; y < img.GetHeight(); y += scale_y) {
-    for (x = 0; x < img.GetWidth(); x += scale_x) {
-      for (int j = 0; j < scale_y; j++) {
-        for (int i = 0; i < scale_x; i++) {
-          alpha_val += img.GetPixel(x + i, y + j).val;
-        }
+std::vector<std::pair<double, double>>
+CImage<T>::ClipPolygon(const std::vector<std::pair<double, double>> &points, double x_min,
+                       double y_min, double x_max, double y_max) {
+  // Sutherland-Hodgman against the four box edges; input and output are
+  // closed the same way CalculateLineBorderPoints closes them
+  std::vector<std::pair<double, double>> out(points);
+  if (!out.empty() && out.front() == out.back()) {
+    out.pop_back();
+  }
+  for (int side = 0; side < 4 && !out.empty(); side++) {
+    auto dist = [&](const std::pair<double, double> &p) {
+      switch (side) {
+        case 0: return p.first - x_min;
+        case 1: return x_max - p.first;
+        case 2: return p.second - y_min;
+        default: return y_max - p.second;
+      }
+    };
+    std::vector<std::pair<double, double>> in;
+    in.swap(out);
+    for (size_t i = 0; i < in.size(); i++) {
+      const std::pair<double, double> &a = in[i];
+      const std::pair<double, double> &b = in[(i + 1) % in.size()];
+      double da = dist(a);
+      double db = dist(b);
+      if (da >= 0) {
+        out.push_back(a);
+      }
+      if ((da >= 0) != (db >= 0)) {
+        double t = da / (da - db);
+        out.emplace_back(a.first + t * (b.first - a.first), a.second + t * (b.second - a.second));
       }
-      alpha_val /= (scale_x * scale_y);
-      T pix = this->GetPixel(x / scale_x + (int) start_coord.first,
-                             y / scale_y + (int) start_coord.second);
-      this->PutPixel(x / scale_x + (int) start_coord.first,
-                     y / scale_y + (int) start_coord.second,
-                     apply_alpha(bright, pix, alpha_val, gamma));
-      alpha_val = 0;
     }
   }
-}
-
-template<class T>
-void
-CImage<T>::plot(CImage &img, double x, double y, double alpha, CMonoPixel bright,
-                double gamma) {
-  if (x >= 0 && y >= 0 && x < img.GetWidth() && y < img.GetHeight()) {
-    img.PutPixel(x, y, apply_alpha(bright, img.GetPixel(x, y), alpha, gamma));
+  if (!out.empty()) {
+    out.push_back(out.front());
   }
+  return out;
 }
 
 template<class T>
-double CImage<T>::intPart(double x) {
-  return floor(x);
+void CImage<T>::FixedRange(long long f0, long long step, long long lo, long long hi,
+                           long long &j_min, long long &j_max) {
+  if (step == 0) {
+    if (f0 < lo || f0 > hi) {
+      j_max = j_min - 1;
+    }
+    return;
+  }
+  if (step < 0) {
+    long long tmp = lo;
+    lo = -hi;
+    hi = -tmp;
+    f0 = -f0;
+    step = -step;
+  }
+  auto floor_div = [](long long a, long long b) {
+    return a >= 0 ? a / b : -((-a + b - 1) / b);
+  };
+  j_min = std::max(j_min, -floor_div(f0 - lo, step));
+  j_max = std::min(j_max, floor_div(hi - f0, step));
 }
 
 template<class T>
-double CImage<T>::FloatPart(double x) {
-  return x - floor(x);
+void CImage<T>::DrawDistanceLine(T color, double thickness, double x1, double y1, double x2,
+                                 double y2, double gamma) {
+  if (!(thickness > 0)) {
+    return;
+  }
+  const CGammaLut &lut = CGammaLut::Get(gamma);
+  double hw = thickness / 2;
+  double reach = hw + 1;
+  // Caps of a cut-off end lie beyond the margin, so the cut is invisible;
+  // it also keeps the float arithmetic below near the canvas
+  double t0, t1;
+  if (!ClipSegment(x1, y1, x2, y2, -reach - 1, -reach - 1, w_ + reach + 1, h_ + reach + 1, t0, t1)) {
+    return;
+  }
+  double dx = x2 - x1;
+  double dy = y2 - y1;
+  double ax = x1 + t0 * dx;
+  double ay = y1 + t0 * dy;
+  double bx = x1 + t1 * dx;
+  double by = y1 + t1 * dy;
+
+  int row_first = std::max((int) floor(std::min(ay, by) - reach), 0);
+  int row_last = std::min((int) ceil(std::max(ay, by) + reach), h_ - 1);
+  std::vector<uchar> alpha(w_);
+  for (int py = row_first; py <= row_last; py++) {
+    // Only the part of the segment within reach of this row matters
+    double s0, s1;
+    if (!ClipSegment(ax, ay, bx, by, -DBL_MAX, py - reach, DBL_MAX, py + reach, s0, s1)) {
+      continue;
+    }
+    double xa = ax + s0 * (bx - ax);
+    double xb = ax + s1 * (bx - ax);
+    int px_first = std::max((int) floor(std::min(xa, xb) - reach), 0);
+    int px_last = std::min((int) ceil(std::max(xa, xb) + reach), w_ - 1);
+    if (px_first > px_last) {
+      continue;
+    }
+    int len = px_last - px_first + 1;
+    CapsuleCoverage((float) px_first, (float) py, len, (float) ax, (float) ay, (float) (bx - ax),
+                    (float) (by - ay), (float) hw, alpha.data());
+    BlendSpan(py, px_first, len, alpha.data(), color, lut);
+  }
 }
 
 template<class T>
-void CImage<T>::DrawWuLine(CMonoPixel brightness, double thickness, double x1,
-                           double y1,
-                           double x2, double y2, double gamma) {
-  bool check = abs(y2 - y1) > abs(x2 - x1);
-  brightness.val *= thickness;
+void CImage<T>::DrawWuLineFixed(T color, double thickness, double x1,
+                                double y1,
+                                double x2, double y2, double gamma) {
+  const CGammaLut &lut = CGammaLut::Get(gamma);
+  bool check = std::abs(y2 - y1) > std::abs(x2 - x1);
+  color = ScalePixel(color, thickness);
   if (check) {
     std::swap(x1, y1);
     std::swap(x2, y2);
@@ -392,177 +1445,306 @@ void CImage<T>::DrawWuLine(CMonoPixel brightness, double thickness, double x1,
     std::swap(y1, y2);
   }
   double dx = x2 - x1;
-  double dy = y2 - y1;
-  double delta = dy / dx;
-
-  if (dx == 0.0) {
-    delta = 1.0;
+  double delta = (dx == 0.0) ? 1.0 : (y2 - y1) / dx;
+
+  auto plot_end = [&](double x, double y) {
+    if (x >= 0 && y >= 0) {
+      if (check) {
+        BlendPixel((int) y, (int) x, color, 255, lut);
+      } else {
+        BlendPixel((int) x, (int) y, color, 255, lut);
+      }
+    }
+  };
+  plot_end(x1, y1);
+  plot_end(x2, y2);
+
+  // Clip the inner columns to the canvas once, with a margin on the minor axis
+  // that the exact integer split below narrows down
+  int major_size = check ? h_ : w_;
+  int minor_size = check ? w_ : h_;
+  double t0, t1;
+  if (!ClipSegment(x1, y1, x1 + dx, y1 + dx * delta, -1.0, -2.0, major_size + 1.0, minor_size + 1.0, t0, t1)) {
+    return;
+  }
+  double fx1 = floor(x1);
+  double c_lo = std::max(std::max(fx1 + 1.0, 0.0), ceil(x1 + t0 * dx));
+  double c_hi = std::min(std::min(fx1 + ceil(dx) - 1.0, major_size - 1.0), floor(x1 + t1 * dx));
+  if (c_lo > c_hi) {
+    return;
+  }
+  int c0 = (int) c_lo;
+  const long long one = 1 << 16;
+  long long fy = std::llround((y1 + (c0 - fx1) * delta) * one);
+  long long step = std::llround(delta * one);
+
+  // Columns touching the canvas at all, and columns whose both rows are inside
+  long long j_any_min = 0;
+  long long j_any_max = (long long) c_hi - c0;
+  FixedRange(fy, step, -one, minor_size * one - 1, j_any_min, j_any_max);
+  long long j_in_min = j_any_min;
+  long long j_in_max = j_any_max;
+  FixedRange(fy, step, 0, (minor_size - 1) * one - 1, j_in_min, j_in_max);
+  if (j_in_min > j_in_max || linear_lut_) {
+    // The raw pointer loop below writes 8-bit pixels only
+    j_in_min = j_any_max + 1;
+    j_in_max = j_any_max;
   }
 
-  if (check) {
-    plot(*this, y1, x1, max_val_, brightness, gamma);
-    plot(*this, y2, x2, max_val_, brightness, gamma);
-    double y = y1 + delta;
-    for (double x = x1 + 1.0; x < x2; x++) {
-      plot(*this, intPart(y), x,
-           (double) max_val_ * (1.0 - FloatPart(y)), brightness,
-           gamma);
-      plot(*this, intPart(y) + 1.0, x,
-           (double) max_val_ * FloatPart(y), brightness, gamma);
-      y += delta;
+  auto plot_column = [&](long long j) {
+    long long f = fy + j * step + one;
+    int row = (int) (f >> 16) - 1;
+    int cov = (int) (f >> 8) & 0xFF;
+    int col = c0 + (int) j;
+    if (check) {
+      BlendPixel(row, col, color, 255 - cov, lut);
+      BlendPixel(row + 1, col, color, cov, lut);
+    } else {
+      BlendPixel(col, row, color, 255 - cov, lut);
+      BlendPixel(col, row + 1, color, cov, lut);
     }
-  } else {
-    plot(*this, x1, y1, max_val_, brightness, gamma);
-    plot(*this, x2, y2, max_val_, brightness, gamma);
-    double y = y1 + delta;
-    for (double x = x1 + 1.0; x < x2; x++) {
-      plot(*this, x, intPart(y),
-           (double) max_val_ * (1.0 - FloatPart(y)), brightness,
-           gamma);
-      plot(*this, x, intPart(y) + 1.0,
-           (double) max_val_ * FloatPart(y), brightness, gamma);
-      y += delta;
+  };
+  for (long long j = j_any_min; j < j_in_min; j++) {
+    plot_column(j);
+  }
+
+  long long major_step = check ? w_ : 1;
+  long long minor_step = check ? 1 : w_;
+  long long f = fy + j_in_min * step;
+  T *column = data_ + (c0 + j_in_min) * major_step;
+  for (long long j = j_in_min; j <= j_in_max; j++) {
+    int cov = (int) (f >> 8) & 0xFF;
+    T *pix = column + (f >> 16) * minor_step;
+    BlendValue(pix[0], color, 255 - cov, lut);
+    BlendValue(pix[minor_step], color, cov, lut);
+    f += step;
+    column += major_step;
+  }
+  if (!dirty_.empty()) {
+    f = fy + j_in_min * step;
+    for (long long j = j_in_min; j <= j_in_max; j++, f += step) {
+      int row = (int) (f >> 16);
+      int col = c0 + (int) j;
+      if (check) {
+        MarkDirty(col, row, row + 1);
+      } else {
+        MarkDirty(row, col, col);
+        MarkDirty(row + 1, col, col);
+      }
     }
   }
+
+  for (long long j = j_in_max + 1; j <= j_any_max; j++) {
+    plot_column(j);
+  }
 }
 
 template<class T>
-void CImage<T>::ShiftPoints(std::vector<std::pair<double, double>> &points,
-                            double shift_x, double shift_y) {
-  for (std::pair<double, double> &p : points) {
-    p.first += shift_x;
-    p.second += shift_y;
-  }
+void CImage<T>::drawCircle(uchar bright, double thickness, double cx, double cy, double r,
+                           double gamma) {
+  drawEllipse(GrayPixel<T>(bright), thickness, cx, cy, r, r, gamma);
 }
 
 template<class T>
-void CImage<T>::Polygon::addActive(int p, double cy) {
-  Point &np = (*this)[p + 1];
-  Point &pnt = (*this)[p];
-  Edge &ne = active[nact];
+void CImage<T>::drawCircle(T color, double thickness, double cx, double cy, double r,
+                           double gamma) {
+  drawEllipse(color, thickness, cx, cy, r, r, gamma);
+}
 
-  if (pnt.y == np.y) {
-    return;
-  } else {
-    double dX = np.x - pnt.x;
-    double dY = np.y - pnt.y;
-    double dy;
-    if (pnt.y < np.y) {
-      ne.dir = -1;
-      ne.x = pnt.x;
-      dy = cy - pnt.y;
-    } else {
-      ne.dir = 1;
-      ne.x = np.x;
-      dy = cy - np.y;
-    }
-    ne.dx = dX / dY;
-    ne.x += (dX * dy) / dY;
-  }
-  pnt.edge = &ne;
-  active_list.push_back(&ne);
-  nact++;
+template<class T>
+void CImage<T>::fillCircle(uchar bright, double cx, double cy, double r, double gamma) {
+  fillEllipse(GrayPixel<T>(bright), cx, cy, r, r, gamma);
 }
 
 template<class T>
-void CImage<T>::Polygon::sortActive() {
-  struct {
-    bool operator()(Edge *a, Edge *b) const {
-      return a->x <= b->x;
-    }
-  } le;
-  std::sort(active_list.begin(), active_list.end(), le);
+void CImage<T>::fillCircle(T color, double cx, double cy, double r, double gamma) {
+  fillEllipse(color, cx, cy, r, r, gamma);
 }
 
 template<class T>
-void CImage<T>::Polygon::delActive(Edge *e) {
-  active_list.erase(std::remove(active_list.begin(), active_list.end(), e),
-                    active_list.end());
+void CImage<T>::drawEllipse(uchar bright, double thickness, double cx, double cy, double rx,
+                            double ry, double gamma) {
+  drawEllipse(GrayPixel<T>(bright), thickness, cx, cy, rx, ry, gamma);
 }
 
 template<class T>
-void CImage<T>::FillPolygon(Polygon &polygon, CImage<T> &img, T color) {
-  double k, y, xl, xr;
-  int drawing;
-  int right_bound = img.GetWidth() - 1;
-  double y_min = polygon.getYMin();
-  double y_max = polygon.getYMax();
-  int hash_size = (int(y_max - y_min)) + 4;
+void CImage<T>::drawEllipse(T color, double thickness, double cx, double cy, double rx,
+                            double ry, double gamma) {
+  double th2 = thickness / 2;
+  DrawConic(color, cx, cy, rx + th2, ry + th2, rx - th2, ry - th2, false, 0, 0, gamma);
+}
 
-  int hash_offset = (int) ceil(y_min - 0.5 - eps);
+template<class T>
+void CImage<T>::fillEllipse(uchar bright, double cx, double cy, double rx, double ry,
+                            double gamma) {
+  fillEllipse(GrayPixel<T>(bright), cx, cy, rx, ry, gamma);
+}
 
-  int counter;
+template<class T>
+void CImage<T>::fillEllipse(T color, double cx, double cy, double rx, double ry, double gamma) {
+  DrawConic(color, cx, cy, rx, ry, 0, 0, false, 0, 0, gamma);
+}
 
-  int counter_mask = -1;
+template<class T>
+void CImage<T>::drawArc(uchar bright, double thickness, double cx, double cy, double rx,
+                        double ry, double start_deg, double end_deg, double gamma) {
+  drawArc(GrayPixel<T>(bright), thickness, cx, cy, rx, ry, start_deg, end_deg, gamma);
+}
 
-  if (polygon.size() <= 1) return;
+template<class T>
+void CImage<T>::drawArc(T color, double thickness, double cx, double cy, double rx, double ry,
+                        double start_deg, double end_deg, double gamma) {
+  double th2 = thickness / 2;
+  DrawConic(color, cx, cy, rx + th2, ry + th2, rx - th2, ry - th2, true, start_deg, end_deg,
+            gamma);
+}
 
-  std::map<int, std::set<int>> y_hash;
+template<class T>
+void CImage<T>::fillArc(uchar bright, double cx, double cy, double rx, double ry,
+                        double start_deg, double end_deg, double gamma) {
+  fillArc(GrayPixel<T>(bright), cx, cy, rx, ry, start_deg, end_deg, gamma);
+}
+
+template<class T>
+void CImage<T>::fillArc(T color, double cx, double cy, double rx, double ry, double start_deg,
+                        double end_deg, double gamma) {
+  DrawConic(color, cx, cy, rx, ry, 0, 0, true, start_deg, end_deg, gamma);
+}
 
-  for (int i = 0; i < polygon.size(); i++) {
-    Point &next_point = polygon[i + 1];
-    int key = (int) ceil(polygon[i].y - hash_offset - 0.5);
-    y_hash[key].insert(i);
-    polygon[i].edge = 0;
+inline double EdgeCoverage(double u0, double u1) {
+  // Mean over the band of the pixel fraction left of an edge that moves
+  // linearly from u0 to u1 (both relative to the pixel's left side)
+  auto area = [](double u) {
+    return u <= 0 ? 0.0 : (u < 1 ? u * u / 2 : u - 0.5);
+  };
+  if (std::abs(u1 - u0) < 1e-9) {
+    return std::min(std::max(u0, 0.0), 1.0);
   }
+  return (area(u1) - area(u0)) / (u1 - u0);
+}
 
-  for (y = hash_offset + 0.5, k = 0;
-       y <= y_max && k <= hash_size; y += 1.0, k++) {
-    for (auto it = y_hash[k].begin(); it != y_hash[k].end(); ++it) {
-      Point &prev = polygon[*it - 1];
-      Point &next = polygon[*it + 1];
-      Point &pt = polygon[*it];
-      if (!prev.last_point) {
-        if (prev.edge && prev.y <= y) {
-          polygon.delActive(prev.edge);
-          prev.edge = 0;
-        } else if (prev.y > y) {
-          polygon.addActive(*it - 1, y);
-        }
+template<class T>
+void CImage<T>::DrawConic(T color, double cx, double cy, double rx, double ry, double rx_in,
+                          double ry_in, bool wedge, double start_deg, double end_deg,
+                          double gamma) {
+  // Every pixel row is cut into bands; inside a band each ellipse boundary is
+  // taken as a straight edge between its x at the band's top and bottom, and
+  // the covered fraction of each pixel is integrated exactly for that edge.
+  // That costs a few sqrt per row and a prefix sum per pixel.
+  const int bands = 4;
+  const CGammaLut &lut = CGammaLut::Get(gamma);
+  if (rx <= 0 || ry <= 0) {
+    return;
+  }
+  bool hole = rx_in > 0 && ry_in > 0;
+  cx += 0.5;
+  cy += 0.5;
+  int y_begin = std::max((int) std::floor(std::max(cy - ry, -1.0)), 0);
+  int y_end = std::min((int) std::ceil(std::min(cy + ry, (double) h_ + 1)), h_);
+  int x_begin = std::max((int) std::floor(std::max(cx - rx, -1.0)), 0);
+  int x_end = std::min((int) std::ceil(std::min(cx + rx, (double) w_ + 1)), w_);
+  if (y_begin >= y_end || x_begin >= x_end) {
+    return;
+  }
+  int width = x_end - x_begin;
+  std::vector<double> delta(width + 1);
+  std::vector<double> partial(width);
+  std::vector<uchar> alpha(width);
+
+  // The wedge is the intersection (sweep <= 180) or the union (sweep > 180)
+  // of the half-planes bounded by the start and end rays
+  double sweep = std::fmod(end_deg - start_deg, 360.0);
+  if (sweep <= 0) {
+    sweep += 360.0;
+  }
+  bool use_wedge = wedge && sweep < 360.0;
+  bool wide = sweep > 180.0;
+  double start_rad = start_deg * M_PI / 180.0;
+  double end_rad = (start_deg + sweep) * M_PI / 180.0;
+  double sx = std::cos(start_rad);
+  double sy = -std::sin(start_rad);
+  double ex = std::cos(end_rad);
+  double ey = -std::sin(end_rad);
+
+  auto half_width = [](double r_x, double r_y, double dy) {
+    double q = 1.0 - (dy / r_y) * (dy / r_y);
+    return q > 0 ? r_x * std::sqrt(q) : 0.0;
+  };
+  auto add_edge = [&](double a, double b, double weight) {
+    int lo = std::min(std::max((int) std::floor(std::min(a, b)), x_begin), x_end);
+    int hi = std::min(std::max((int) std::ceil(std::max(a, b)), x_begin), x_end);
+    delta[0] += weight;
+    delta[lo - x_begin] -= weight;
+    for (int px = lo; px < hi; px++) {
+      partial[px - x_begin] += weight * EdgeCoverage(a - px, b - px);
+    }
+  };
+
+  std::vector<double> outer(bands + 1);
+  std::vector<double> inner(bands + 1);
+  for (int py = y_begin; py < y_end; py++) {
+    for (int k = 0; k <= bands; k++) {
+      double dy = py + (double) k / bands - cy;
+      outer[k] = half_width(rx, ry, dy);
+      inner[k] = hole ? half_width(rx_in, ry_in, dy) : 0.0;
+    }
+    bool empty = true;
+    for (int k = 0; k < bands; k++) {
+      if (outer[k] == 0 && outer[k + 1] == 0) {
+        continue;
       }
-
-      if (!pt.last_point) {
-        if (pt.edge && next.y <= y) {
-          polygon.delActive(pt.edge);
-          pt.edge = 0;
-        } else if (next.y > y) {
-          polygon.addActive(*it, y);
-        }
+      empty = false;
+      double weight = 1.0 / bands;
+      add_edge(cx + outer[k], cx + outer[k + 1], weight);
+      add_edge(cx - outer[k], cx - outer[k + 1], -weight);
+      if (inner[k] > 0 || inner[k + 1] > 0) {
+        add_edge(cx + inner[k], cx + inner[k + 1], -weight);
+        add_edge(cx - inner[k], cx - inner[k + 1], weight);
       }
     }
+    if (empty) {
+      continue;
+    }
 
-    if (polygon.active_list.empty()) continue;
-
-    polygon.sortActive();
-
-    xl = xr = 0;
-    counter = 0;
-    drawing = 0;
-    for (auto curEdge : polygon.active_list) {
-      counter += curEdge->dir;
-      if ((counter & counter_mask) && !drawing) {
-        xl = floor(curEdge->x);
-        drawing = 1;
-      }
-
-      if (!(counter & counter_mask) && drawing) {
-        xr = floor(curEdge->x);
-
-        if (xl <= xr) {
-          for (int i = xl; i <= xr; i++) {
-            img.PutPixel(i, y, color);
-          }
-        }
-        drawing = 0;
+    double run = 0;
+    double ds = -(sx * (py + 0.5 - cy) - sy * (x_begin + 0.5 - cx));
+    double de = ex * (py + 0.5 - cy) - ey * (x_begin + 0.5 - cx);
+    for (int i = 0; i < width; i++) {
+      run += delta[i];
+      double cov = std::min(std::max(run + partial[i], 0.0), 1.0);
+      if (use_wedge && cov > 0) {
+        double cs = std::min(std::max(ds + 0.5, 0.0), 1.0);
+        double ce = std::min(std::max(de + 0.5, 0.0), 1.0);
+        cov *= wide ? std::max(cs, ce) : std::min(cs, ce);
       }
-
-      curEdge->x += curEdge->dx;
+      alpha[i] = (uchar) std::lround(cov * 255);
+      delta[i] = 0;
+      partial[i] = 0;
+      ds += sy;
+      de -= ey;
     }
+    delta[width] = 0;
 
-    if (drawing && xl <= right_bound) {
-      for (int i = xl; i <= right_bound; i++) {
-        img.PutPixel(i, y, color);
+    int i = 0;
+    while (i < width) {
+      if (!alpha[i]) {
+        i++;
+        continue;
       }
+      int start = i;
+      while (i < width && alpha[i]) {
+        i++;
+      }
+      BlendSpan(py, x_begin + start, i - start, &alpha[start], color, lut);
     }
   }
-}
\ No newline at end of file
+}
+
+template<class T>
+void CImage<T>::ShiftPoints(std::vector<std::pair<double, double>> &points,
+                            double shift_x, double shift_y) {
+  for (std::pair<double, double> &p : points) {
+    p.first += shift_x;
+    p.second += shift_y;
+  }
+}
@@ -5,17 +5,35 @@
 #ifndef COMPUTERGEOMETRY_GRAPHICS_CIMAGE_H
 #define COMPUTERGEOMETRY_GRAPHICS_CIMAGE_H
 typedef unsigned char uchar;
+#include <cstdio>
 #include <string>
 #include <vector>
 #include <cfloat>
 #include <algorithm>
 #include <cmath>
+#include <memory>
+#include "CCoverageMaskCache.h"
+#include "CFont.h"
+#include "CGammaLut.h"
+#include "CScanlineRasterizer.h"
+#include "CSparseCoverage.h"
+#include "CStroker.h"
+#include "CThreadPool.h"
 
 enum FileType {
   P5 = 5,
   P6
 };
 
+// SUPERSAMPLED_STROKE fills the inside of the stroke rectangle solid and
+// supersamples only the pixels on its border (see SetEdgeSampling),
+// DISTANCE_STROKE takes coverage from each pixel's distance to the segment
+// (round caps)
+enum StrokeMethod {
+  SUPERSAMPLED_STROKE,
+  DISTANCE_STROKE
+};
+
 struct CMonoPixel {
   uchar val;
 };
@@ -24,6 +42,25 @@ struct CColorPixel {
   uchar r, g, b;
 };
 
+// Half-open pixel rectangle [x_min, x_max) x [y_min, y_max)
+struct DirtyRect {
+  int x_min, y_min;
+  int x_max, y_max;
+};
+
+// Stroke of a drawLines batch. Grey strokes (CMonoPixel) can be drawn on
+// both image types, colored ones only on P6 images
+template<class P>
+struct CLineSpec {
+  P color;
+  double thickness;
+  double x1, y1, x2, y2;
+};
+
+typedef CLineSpec<CMonoPixel> LineSpec;
+
+typedef CLineSpec<CColorPixel> ColorLineSpec;
+
 template<class T>
 class CImage {
  public:
@@ -43,12 +80,23 @@ class CImage {
 
   void writeImg();
 
+  // Appends the image to an open stream; consecutive images form a
+  // multi-image PNM file
+  void writeImg(FILE *f);
+
+  // Rewrites only the rows changed since the previous call, provided that
+  // call wrote the same fname and it still holds an image of the same
+  // format; writes it whole otherwise
+  void writeChangedRows(const std::string &fname);
+
   T GetPixel(int x, int y) const;
 
   void PutPixel(int x, int y, T pixel);
 
   T *operator[](int i);
 
+  const T *operator[](int i) const;
+
   int GetWidth() const;
 
   int GetHeight() const;
@@ -56,123 +104,173 @@ class CImage {
   int GetMaxVal() const;
 
   void drawLine(uchar bright, double thickness, double x1, double y1, double x2,
-                double y2, double gamma);
+                double y2, double gamma, StrokeMethod method = SUPERSAMPLED_STROKE);
 
- private:
-  const double eps = 1e-10;
-  const int MAX_HEADER_SIZE = 50;
-  std::string fname_;
-  FileType type_;
-  int w_, h_;
-  int max_val_;
-  T *data_;
+  void drawLine(T color, double thickness, double x1, double y1, double x2, double y2,
+                double gamma, StrokeMethod method = SUPERSAMPLED_STROKE);
 
-  bool FileExists(const char *s);
+  // Runs on a pool the image keeps between calls, rebuilt only when the
+  // thread count changes (threads <= 0 takes every core)
+  template<class P>
+  void drawLines(const std::vector<CLineSpec<P>> &lines, double gamma, int threads = 0);
+
+  // Same on the caller's pool, which must not be inside another ParallelFor
+  template<class P>
+  void drawLines(const std::vector<CLineSpec<P>> &lines, double gamma, CThreadPool &pool);
+
+  void drawCircle(uchar bright, double thickness, double cx, double cy, double r, double gamma);
+
+  void drawCircle(T color, double thickness, double cx, double cy, double r, double gamma);
+
+  void fillCircle(uchar bright, double cx, double cy, double r, double gamma);
+
+  void fillCircle(T color, double cx, double cy, double r, double gamma);
+
+  void drawEllipse(uchar bright, double thickness, double cx, double cy, double rx, double ry,
+                   double gamma);
+
+  void drawEllipse(T color, double thickness, double cx, double cy, double rx, double ry,
+                   double gamma);
+
+  void fillEllipse(uchar bright, double cx, double cy, double rx, double ry, double gamma);
 
-  struct Edge {
-    double x;
-    double dx;
-    int dir;
-  };
+  void fillEllipse(T color, double cx, double cy, double rx, double ry, double gamma);
 
-  struct Point {
-    double x;
-    double y;
-    int last_point;
-    Edge *edge;
-  };
+  void drawArc(uchar bright, double thickness, double cx, double cy, double rx, double ry,
+               double start_deg, double end_deg, double gamma);
 
-  struct Polygon {
-    double y_min;
-    double y_max;
+  void drawArc(T color, double thickness, double cx, double cy, double rx, double ry,
+               double start_deg, double end_deg, double gamma);
 
-    double getYMin() const {
-      return y_min;
-    }
+  void fillArc(uchar bright, double cx, double cy, double rx, double ry, double start_deg,
+               double end_deg, double gamma);
 
-    double getYMax() const {
-      return y_max;
-    }
+  void fillArc(T color, double cx, double cy, double rx, double ry, double start_deg,
+               double end_deg, double gamma);
 
-    std::vector<Point> points;
-    std::vector<Edge> active;
-    std::vector<Edge *> active_list;
-    int nact;
+  void drawPath(const CPath &path, uchar bright, double thickness, LineJoin join, LineCap cap,
+                double gamma);
 
-    Polygon() : points(), active(), active_list(), nact(0) {
-      y_min = DBL_MAX;
-      y_max = DBL_MIN;
-    }
+  void drawPath(const CPath &path, T color, double thickness, LineJoin join, LineCap cap,
+                double gamma);
 
-    void add(double x, double y) {
-      Point p = {x, y};
-      p.last_point = 0;
-      if (y > y_max) y_max = y;
-      if (y < y_min) y_min = y;
-      points.push_back(p);
-      active.push_back(Edge());
-    }
+  // Fills all contours at once with one shared edge table; coordinates are
+  // continuous, pixel (x, y) covering [x, x + 1) x [y, y + 1)
+  void fillPolygons(const std::vector<std::vector<std::pair<double, double>>> &contours,
+                    uchar bright, FillRule rule, double gamma);
 
-    void GroupAdd(const std::vector<std::pair<double, double>> &points_group) {
-      for (std::pair<double, double> p : points_group) {
-        Point point = {p.first, p.second};
-        point.last_point = 0;
-        if (p.second > y_max) y_max = p.second;
-        if (p.second < y_min) y_min = p.second;
-        points.push_back(point);
-        active.push_back(Edge());
-      }
-    }
+  void fillPolygons(const std::vector<std::vector<std::pair<double, double>>> &contours,
+                    T color, FillRule rule, double gamma);
 
-    void close() {
-      if (!points.empty()) {
-        points[points.size() - 1].last_point = true;
-      }
-    }
+  void drawPolyline(const std::vector<std::pair<double, double>> &points, uchar bright,
+                    double thickness, LineJoin join, LineCap cap, double gamma);
 
-    int size() {
-      return points.size();
-    }
+  void drawPolyline(const std::vector<std::pair<double, double>> &points, T color,
+                    double thickness, LineJoin join, LineCap cap, double gamma);
 
-    Point &operator[](int i) {
-      return points[(i + points.size()) % points.size()];
-    }
+  // (x, y) is the top left corner of the first line; '\n' starts a new one.
+  // Glyphs are blown up by an integer scale
+  void drawText(const CFont &font, const std::string &text, int x, int y, uchar bright,
+                double gamma, int scale = 1);
 
-    void delActive(Edge *e);
+  void drawText(const CFont &font, const std::string &text, int x, int y, T color, double gamma,
+                int scale = 1);
 
-    void addActive(int pnt, double cy);
+  // Thick drawLine strokes are rasterized once per quantized shape and then
+  // blitted from the cache; nullptr turns caching off. Not owned.
+  void SetMaskCache(CCoverageMaskCache *cache);
 
-    void sortActive();
+  // Samples per axis taken in the edge pixels of supersampled strokes,
+  // clamped to 4..16 (4 by default)
+  void SetEdgeSampling(int rate);
 
-  };
+  // Records the pixels touched by drawing (off by default); enabling it
+  // marks the whole image as changed for writeChangedRows
+  void TrackDirty(bool enable);
 
-  void FillPolygon(Polygon &polygon, CImage<T> &img, T color);
+  std::vector<DirtyRect> GetDirtyRects() const;
 
-  void plot(CImage &img, double x, double y, double alpha, CMonoPixel bright, double gamma);
+  void ClearDirty();
 
-  double intPart(double x);
+  // Copies the dirty pixels back from a same-sized background and clears them
+  void RestoreDirty(const CImage &background);
 
-  double FloatPart(double x);
+  // Between BeginLinear and EndLinear all drawing composites into a float
+  // canvas in linear light with the given gamma (the gamma passed to the
+  // drawing calls is ignored), and the pixels are encoded back only once.
+  // GetPixel, PutPixel, RestoreDirty, the writes and copies go through the
+  // canvas meanwhile; operator[] does not and sees the pixels as they were
+  // at the last write. Calling BeginLinear again ends the current canvas
+  void BeginLinear(double gamma);
+
+  void EndLinear();
+
+  void BlendSpan(int y, int x, int len, const uchar *coverage, T color, const CGammaLut &lut);
+
+ private:
+  const double eps = 1e-10;
+  const int MAX_HEADER_SIZE = 50;
+  static const int TILE_SIZE = 64;
+  std::string fname_;
+  FileType type_;
+  int w_, h_;
+  int max_val_;
+  T *data_;
+  CCoverageMaskCache *mask_cache_ = nullptr;
+  int edge_samples_ = 4;
+  // Per-row inclusive x extents, empty when tracking is off; dirty_ is what
+  // RestoreDirty undoes, changed_ is what writeChangedRows has to write
+  std::vector<std::pair<int, int>> dirty_;
+  std::vector<std::pair<int, int>> changed_;
+  std::string changed_fname_;
+
+  std::vector<float> linear_;
+  const CGammaLut *linear_lut_ = nullptr;
+
+  std::unique_ptr<CThreadPool> pool_;
+
+  void MarkDirty(int y, int x_left, int x_right);
+
+  // Encodes the linear canvas into data_ and keeps it open
+  void SyncLinear();
+
+  void CompositeRow(int y, int x, int len, const uchar *coverage, T color, const CGammaLut &lut);
+
+  bool FileExists(const char *s);
+
+  std::vector<std::pair<double, double>> StrokeOutline(double thickness, double x1, double y1,
+                                                       double x2, double y2);
 
   std::vector<std::pair<double, double>> CalculateLineBorderPoints(double thickness, double x1, double y1,
                                                                    double x2, double y2);
-  void ScaleBorderPoints(std::vector<std::pair<double, double>> &points, int scale_x, int scale_y);
-
-  std::pair<double, double> GetScaledBounds(const std::vector<std::pair<double, double>> &points,
-                                            int scale_x,
-                                            int scale_y);
 
   std::pair<double, double> GetUpperCorner(const std::vector<std::pair<double, double>> &points);
 
-  void DrawDownscaled(const CImage<CMonoPixel> &img,
-                      int scale_x,
-                      int scale_y,
-                      const std::pair<double, double> &start_coord,
-                      T bright,
+  template<class RowFn>
+  void RasterizeConvex(const std::vector<std::pair<double, double>> &points, int x_min, int y_min,
+                       int x_max, int y_max, RowFn fn);
+
+  bool DrawCachedLine(T color, double thickness, double x1, double y1, double x2, double y2,
                       double gamma);
 
-  void DrawWuLine(CMonoPixel bright, double thickness, double x1, double y1, double x2,
-                  double y2, double gamma);
+  void DrawDistanceLine(T color, double thickness, double x1, double y1, double x2, double y2,
+                        double gamma);
+
+  void DrawWuLineFixed(T color, double thickness, double x1, double y1, double x2,
+                       double y2, double gamma);
+
+  void BlendPixel(int x, int y, T color, int alpha, const CGammaLut &lut);
+
+  bool ClipSegment(double x1, double y1, double x2, double y2, double x_min, double y_min,
+                   double x_max, double y_max, double &t0, double &t1);
+
+  std::vector<std::pair<double, double>> ClipPolygon(const std::vector<std::pair<double, double>> &points,
+                                                     double x_min, double y_min, double x_max, double y_max);
+
+  void FixedRange(long long f0, long long step, long long lo, long long hi, long long &j_min, long long &j_max);
+
+  void DrawConic(T color, double cx, double cy, double rx, double ry, double rx_in, double ry_in,
+                 bool wedge, double start_deg, double end_deg, double gamma);
 
   void ShiftPoints(std::vector<std::pair<double, double>> &points, double shift_x, double shift_y);
 };
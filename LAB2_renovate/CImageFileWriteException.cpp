@@ -0,0 +1,6 @@
+#include "CImageFileWriteException.h"
+
+CImageFileWriteException::CImageFileWriteException()
+    : CImageException("EXCEPTION: Error while writing data") {
+
+}
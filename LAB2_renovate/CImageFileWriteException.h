@@ -0,0 +1,11 @@
+#ifndef COMPUTERGEOMETRY_GRAPHICS_CIMAGEFILEWRITEEXCEPTION_H
+#define COMPUTERGEOMETRY_GRAPHICS_CIMAGEFILEWRITEEXCEPTION_H
+
+#include "CImageException.h"
+
+class CImageFileWriteException : public CImageException {
+ public:
+  CImageFileWriteException();
+};
+
+#endif //COMPUTERGEOMETRY_GRAPHICS_CIMAGEFILEWRITEEXCEPTION_H
@@ -0,0 +1,128 @@
+#include <algorithm>
+#include <cmath>
+
+#include "CPath.h"
+
+void CPath::MoveTo(double x, double y) {
+  verbs_.push_back(MOVE);
+  points_.emplace_back(x, y);
+}
+
+void CPath::LineTo(double x, double y) {
+  EnsureStarted();
+  verbs_.push_back(LINE);
+  points_.emplace_back(x, y);
+}
+
+void CPath::QuadTo(double cx, double cy, double x, double y) {
+  EnsureStarted();
+  verbs_.push_back(QUAD);
+  points_.emplace_back(cx, cy);
+  points_.emplace_back(x, y);
+}
+
+void CPath::CubicTo(double cx1, double cy1, double cx2, double cy2, double x, double y) {
+  EnsureStarted();
+  verbs_.push_back(CUBIC);
+  points_.emplace_back(cx1, cy1);
+  points_.emplace_back(cx2, cy2);
+  points_.emplace_back(x, y);
+}
+
+void CPath::Close() {
+  if (!verbs_.empty() && verbs_.back() != CLOSE) {
+    verbs_.push_back(CLOSE);
+  }
+}
+
+bool CPath::Empty() const {
+  return verbs_.empty();
+}
+
+void CPath::EnsureStarted() {
+  // A segment after Close (or on an empty path) starts where the last
+  // subpath started, as in SVG and PostScript
+  if (verbs_.empty()) {
+    MoveTo(0, 0);
+  } else if (verbs_.back() == CLOSE) {
+    size_t p = points_.size();
+    for (size_t i = verbs_.size(); i-- > 0;) {
+      if (verbs_[i] == MOVE) {
+        break;
+      }
+      p -= verbs_[i] == QUAD ? 2 : (verbs_[i] == CUBIC ? 3 : (verbs_[i] == LINE ? 1 : 0));
+    }
+    std::pair<double, double> start = points_[p - 1];
+    MoveTo(start.first, start.second);
+  }
+}
+
+std::vector<CPath::Polyline> CPath::Flatten(double tolerance) const {
+  std::vector<Polyline> out;
+  tolerance = std::max(tolerance, 1e-3);
+  size_t p = 0;
+  auto add = [&](double x, double y) {
+    std::vector<std::pair<double, double>> &pts = out.back().points;
+    if (pts.empty() || pts.back().first != x || pts.back().second != y) {
+      pts.emplace_back(x, y);
+    }
+  };
+  for (Verb verb : verbs_) {
+    switch (verb) {
+      case MOVE: {
+        out.push_back({{}, false});
+        add(points_[p].first, points_[p].second);
+        p++;
+        break;
+      }
+      case LINE: {
+        add(points_[p].first, points_[p].second);
+        p++;
+        break;
+      }
+      case QUAD:
+      case CUBIC: {
+        // Uniform steps with the count from the curve's second differences:
+        // the chord error of a step h is at most max|B''| * h^2 / 8
+        std::pair<double, double> p0 = out.back().points.back();
+        const std::pair<double, double> *c = &points_[p];
+        double dd;
+        if (verb == QUAD) {
+          dd = 2 * std::hypot(p0.first - 2 * c[0].first + c[1].first,
+                              p0.second - 2 * c[0].second + c[1].second);
+        } else {
+          dd = 6 * std::max(std::hypot(p0.first - 2 * c[0].first + c[1].first,
+                                       p0.second - 2 * c[0].second + c[1].second),
+                            std::hypot(c[0].first - 2 * c[1].first + c[2].first,
+                                       c[0].second - 2 * c[1].second + c[2].second));
+        }
+        int n = std::max(1, (int) std::ceil(std::sqrt(dd / (8 * tolerance))));
+        n = std::min(n, 4096);
+        for (int i = 1; i <= n; i++) {
+          double t = (double) i / n;
+          double s = 1 - t;
+          if (verb == QUAD) {
+            add(s * s * p0.first + 2 * s * t * c[0].first + t * t * c[1].first,
+                s * s * p0.second + 2 * s * t * c[0].second + t * t * c[1].second);
+          } else {
+            add(s * s * s * p0.first + 3 * s * s * t * c[0].first + 3 * s * t * t * c[1].first
+                    + t * t * t * c[2].first,
+                s * s * s * p0.second + 3 * s * s * t * c[0].second + 3 * s * t * t * c[1].second
+                    + t * t * t * c[2].second);
+          }
+        }
+        p += verb == QUAD ? 2 : 3;
+        break;
+      }
+      case CLOSE: {
+        Polyline &line = out.back();
+        if (line.points.size() > 1 && line.points.front() == line.points.back()) {
+          line.points.pop_back();
+        }
+        line.closed = true;
+        break;
+      }
+    }
+  }
+  return out;
+}
@@ -0,0 +1,46 @@
+#ifndef COMPUTERGEOMETRY_GRAPHICS_CPATH_H
+#define COMPUTERGEOMETRY_GRAPHICS_CPATH_H
+
+#include <utility>
+#include <vector>
+
+// Vector path of lines and quadratic/cubic Bezier segments, split into
+// subpaths by MoveTo. Flatten turns it into polylines whose distance to the
+// curves stays within the given tolerance (in pixels).
+class CPath {
+ public:
+  struct Polyline {
+    std::vector<std::pair<double, double>> points;
+    bool closed;
+  };
+
+  void MoveTo(double x, double y);
+
+  void LineTo(double x, double y);
+
+  void QuadTo(double cx, double cy, double x, double y);
+
+  void CubicTo(double cx1, double cy1, double cx2, double cy2, double x, double y);
+
+  void Close();
+
+  bool Empty() const;
+
+  std::vector<Polyline> Flatten(double tolerance) const;
+
+ private:
+  enum Verb {
+    MOVE,
+    LINE,
+    QUAD,
+    CUBIC,
+    CLOSE
+  };
+
+  std::vector<Verb> verbs_;
+  std::vector<std::pair<double, double>> points_;
+
+  void EnsureStarted();
+};
+
+#endif //COMPUTERGEOMETRY_GRAPHICS_CPATH_H
@@ -0,0 +1,83 @@
+#include <cmath>
+
+#include "CScanlineRasterizer.h"
+
+CScanlineRasterizer::CScanlineRasterizer(int w, int h, int sub_x, int sub_y)
+    : x_min_(0), y_min_(0), x_max_(w), y_max_(h), sub_x_(sub_x), sub_y_(sub_y), rule_(NON_ZERO) {
+
+}
+
+void CScanlineRasterizer::SetClipBox(int x_min, int y_min, int x_max, int y_max) {
+  x_min_ = x_min;
+  y_min_ = y_min;
+  x_max_ = x_max;
+  y_max_ = y_max;
+}
+
+void CScanlineRasterizer::SetFillRule(FillRule rule) {
+  rule_ = rule;
+}
+
+void CScanlineRasterizer::Reset() {
+  edges_.clear();
+}
+
+bool CScanlineRasterizer::Empty() const {
+  return edges_.empty();
+}
+
+void CScanlineRasterizer::AddContour(const std::vector<std::pair<double, double>> &points) {
+  size_t n = points.size();
+  if (n > 1 && points.front() == points.back()) {
+    n--;
+  }
+  for (size_t i = 0; i < n; i++) {
+    std::pair<double, double> a = points[i];
+    std::pair<double, double> b = points[(i + 1) % n];
+    if (!std::isfinite(a.first) || !std::isfinite(a.second)
+        || !std::isfinite(b.first) || !std::isfinite(b.second)) {
+      continue;
+    }
+    Edge e;
+    e.dir = 1;
+    if (a.second > b.second) {
+      std::swap(a, b);
+      e.dir = -1;
+    }
+    // Sample rows sit at sub-scanline centres
+    int s_min = y_min_ * sub_y_;
+    int s_max = y_max_ * sub_y_;
+    e.s_begin = std::max((int) std::ceil(std::max(a.second * sub_y_ - 0.5, s_min - 1.0)), s_min);
+    e.s_end = std::min((int) std::ceil(std::min(b.second * sub_y_ - 0.5, s_max + 1.0)), s_max);
+    if (e.s_begin >= e.s_end) {
+      continue;
+    }
+    e.x0 = a.first;
+    e.y0 = a.second;
+    e.dxdy = (b.first - a.first) / (b.second - a.second);
+    edges_.push_back(e);
+  }
+}
+
+void CScanlineRasterizer::AccumulateSpan(double xa, double xb, int &px_min, int &px_max) {
+  // Subsample positions relative to the left edge of the clip box
+  double limit = (double) (x_max_ - x_min_) * sub_x_;
+  double origin = (double) x_min_ * sub_x_;
+  int sa = (int) std::lround(std::min(std::max(xa * sub_x_ - origin, 0.0), limit));
+  int sb = (int) std::lround(std::min(std::max(xb * sub_x_ - origin, 0.0), limit));
+  if (sa >= sb) {
+    return;
+  }
+  int pa = sa / sub_x_;
+  int pb = sb / sub_x_;
+  if (pa == pb) {
+    cover_[pa] += sb - sa;
+  } else {
+    cover_[pa] += (pa + 1) * sub_x_ - sa;
+    delta_[pa + 1] += sub_x_;
+    delta_[pb] -= sub_x_;
+    cover_[pb] += sb - pb * sub_x_;
+  }
+  px_min = std::min(px_min, pa);
+  px_max = std::max(px_max, pb);
+}
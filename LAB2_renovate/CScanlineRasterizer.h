@@ -0,0 +1,144 @@
+#ifndef COMPUTERGEOMETRY_GRAPHICS_CSCANLINERASTERIZER_H
+#define COMPUTERGEOMETRY_GRAPHICS_CSCANLINERASTERIZER_H
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+typedef unsigned char uchar;
+
+enum FillRule {
+  NON_ZERO,
+  EVEN_ODD
+};
+
+// Anti-aliased polygon filler for batches of contours. All contours share one
+// edge list and are filled together by the nonzero or even-odd rule;
+// coverage is accumulated per pixel row from sub_x * sub_y samples and handed
+// out as runs of 0..255 alpha, one call per run.
+class CScanlineRasterizer {
+ public:
+  CScanlineRasterizer(int w, int h, int sub_x = 4, int sub_y = 4);
+
+  void Reset();
+
+  // Limits rasterization to the pixel box [x_min, x_max) x [y_min, y_max);
+  // contours may extend past it
+  void SetClipBox(int x_min, int y_min, int x_max, int y_max);
+
+  void SetFillRule(FillRule rule);
+
+  void AddContour(const std::vector<std::pair<double, double>> &points);
+
+  bool Empty() const;
+
+  // fn(int y, int x, int len, const uchar *coverage)
+  template<class SpanFn>
+  void Sweep(SpanFn fn);
+
+ private:
+  struct Edge {
+    double x0, y0;
+    double dxdy;
+    int dir;
+    int s_begin, s_end;
+  };
+
+  int x_min_, y_min_, x_max_, y_max_;
+  int sub_x_, sub_y_;
+  FillRule rule_;
+  std::vector<Edge> edges_;
+  std::vector<int> cover_;
+  std::vector<int> delta_;
+  std::vector<uchar> alpha_;
+
+  void AccumulateSpan(double xa, double xb, int &px_min, int &px_max);
+};
+
+template<class SpanFn>
+void CScanlineRasterizer::Sweep(SpanFn fn) {
+  if (edges_.empty()) {
+    return;
+  }
+  std::sort(edges_.begin(), edges_.end(), [](const Edge &a, const Edge &b) {
+    return a.s_begin < b.s_begin;
+  });
+  int s_last = 0;
+  for (const Edge &e : edges_) {
+    s_last = std::max(s_last, e.s_end);
+  }
+  int row_first = edges_.front().s_begin / sub_y_;
+  int row_last = (s_last - 1) / sub_y_;
+  int w = x_max_ - x_min_;
+
+  cover_.assign(w + 2, 0);
+  delta_.assign(w + 2, 0);
+  alpha_.assign(w + 1, 0);
+  std::vector<int> active;
+  std::vector<std::pair<double, int>> crossings;
+  size_t next = 0;
+  int full = sub_x_ * sub_y_;
+
+  for (int y = row_first; y <= row_last; y++) {
+    int px_min = w;
+    int px_max = -1;
+    for (int s = y * sub_y_; s < (y + 1) * sub_y_; s++) {
+      while (next < edges_.size() && edges_[next].s_begin <= s) {
+        active.push_back((int) next++);
+      }
+      active.erase(std::remove_if(active.begin(), active.end(), [&](int i) {
+        return edges_[i].s_end <= s;
+      }), active.end());
+      if (active.empty()) {
+        continue;
+      }
+
+      double ys = (s + 0.5) / sub_y_;
+      crossings.clear();
+      for (int i : active) {
+        const Edge &e = edges_[i];
+        crossings.emplace_back(e.x0 + (ys - e.y0) * e.dxdy, e.dir);
+      }
+      std::sort(crossings.begin(), crossings.end());
+
+      int mask = rule_ == EVEN_ODD ? 1 : -1;
+      int winding = 0;
+      double x_start = 0;
+      for (const std::pair<double, int> &c : crossings) {
+        int prev = winding;
+        winding += c.second;
+        if (!(prev & mask) && (winding & mask)) {
+          x_start = c.first;
+        } else if ((prev & mask) && !(winding & mask)) {
+          AccumulateSpan(x_start, c.first, px_min, px_max);
+        }
+      }
+    }
+
+    if (px_min > px_max) {
+      continue;
+    }
+    int run = 0;
+    for (int x = px_min; x <= px_max; x++) {
+      run += delta_[x];
+      alpha_[x] = (uchar) ((run + cover_[x]) * 255 / full);
+      delta_[x] = 0;
+      cover_[x] = 0;
+    }
+
+    int x = px_min;
+    while (x <= px_max) {
+      if (!alpha_[x]) {
+        x++;
+        continue;
+      }
+      int start = x;
+      while (x <= px_max && alpha_[x]) {
+        x++;
+      }
+      fn(y, x_min_ + start, x - start, &alpha_[start]);
+    }
+  }
+}
+
+#endif //COMPUTERGEOMETRY_GRAPHICS_CSCANLINERASTERIZER_H
@@ -0,0 +1,30 @@
+#include "CSparseCoverage.h"
+
+CSparseCoverage::CSparseCoverage(int w, int h, int scale_x, int scale_y)
+    : w_(w), h_(h), scale_x_(scale_x), scale_y_(scale_y),
+      rows_((h + scale_y - 1) / scale_y) {
+}
+
+int CSparseCoverage::GetWidth() const {
+  return w_;
+}
+
+int CSparseCoverage::GetHeight() const {
+  return h_;
+}
+
+void CSparseCoverage::AddCover(int row, int x, int cover) {
+  if (row < 0 || row >= (int) rows_.size() || cover <= 0) {
+    return;
+  }
+  rows_[row].push_back({x, cover, 0});
+}
+
+void CSparseCoverage::AddRun(int row, int x_begin, int x_end) {
+  if (row < 0 || row >= (int) rows_.size() || x_begin >= x_end) {
+    return;
+  }
+  int full = scale_x_ * scale_y_;
+  rows_[row].push_back({x_begin, 0, full});
+  rows_[row].push_back({x_end, 0, -full});
+}
@@ -0,0 +1,90 @@
+#ifndef COMPUTERGEOMETRY_GRAPHICS_CSPARSECOVERAGE_H
+#define COMPUTERGEOMETRY_GRAPHICS_CSPARSECOVERAGE_H
+
+#include <algorithm>
+#include <vector>
+
+typedef unsigned char uchar;
+
+// Supersampled coverage kept as run-length cells per output pixel row, in
+// the manner of AGG and FreeType: every span adds at most three cells, so
+// memory follows the outline's perimeter instead of its bounding box.
+// RasterizeConvex writes the cells directly; Resolve gives the same alpha as
+// box-filtering a dense supersampled image.
+class CSparseCoverage {
+ public:
+  // w, h are in supersampled units
+  CSparseCoverage(int w, int h, int scale_x, int scale_y);
+
+  int GetWidth() const;
+
+  int GetHeight() const;
+
+  // Direct writes in pixel units: cover samples of one pixel of the row,
+  // or a run of fully covered pixels [x_begin, x_end)
+  void AddCover(int row, int x, int cover);
+
+  void AddRun(int row, int x_begin, int x_end);
+
+  // fn(int row, int x, int len, const uchar *alpha) for every non-empty
+  // output row, in pixel units
+  template<class RowFn>
+  void Resolve(RowFn fn);
+
+ private:
+  struct Cell {
+    int x;
+    int cover;
+    int delta;
+
+    bool operator<(const Cell &other) const {
+      return x < other.x;
+    }
+  };
+
+  int w_, h_;
+  int scale_x_, scale_y_;
+  std::vector<std::vector<Cell>> rows_;
+  std::vector<uchar> alpha_;
+};
+
+template<class RowFn>
+void CSparseCoverage::Resolve(RowFn fn) {
+  int full = scale_x_ * scale_y_;
+  for (int row = 0; row < (int) rows_.size(); row++) {
+    std::vector<Cell> &cells = rows_[row];
+    if (cells.empty()) {
+      continue;
+    }
+    std::sort(cells.begin(), cells.end());
+    int x_first = cells.front().x;
+    int len = cells.back().x - x_first + 1;
+    alpha_.resize(len);
+    // Walk the cells; the pixels between two cells all take the running
+    // count, so interior runs cost a fill
+    int run = 0;
+    size_t c = 0;
+    while (c < cells.size()) {
+      int x = cells[c].x;
+      int cover = 0;
+      while (c < cells.size() && cells[c].x == x) {
+        run += cells[c].delta;
+        cover += cells[c].cover;
+        c++;
+      }
+      alpha_[x - x_first] = (uchar) (std::min(run + cover, full) * 255 / full);
+      int next = c < cells.size() ? cells[c].x : x + 1;
+      std::fill(alpha_.begin() + (x - x_first + 1), alpha_.begin() + (next - x_first),
+                (uchar) (std::min(run, full) * 255 / full));
+    }
+    // A run closing on the last pixel leaves an empty cell past it
+    while (len > 0 && !alpha_[len - 1]) {
+      len--;
+    }
+    if (len > 0) {
+      fn(row, x_first, len, alpha_.data());
+    }
+  }
+}
+
+#endif //COMPUTERGEOMETRY_GRAPHICS_CSPARSECOVERAGE_H
@@ -0,0 +1,146 @@
+#include <algorithm>
+#include <cmath>
+
+#include "CStroker.h"
+
+CStroker::CStroker(double thickness, LineJoin join, LineCap cap, double miter_limit,
+                   double tolerance)
+    : half_width_(thickness / 2), join_(join), cap_(cap),
+      miter_limit_(std::max(miter_limit, 1.0)), tolerance_(std::max(tolerance, 1e-3)) {
+}
+
+std::vector<CStroker::Contour> CStroker::Stroke(const CPath &path) const {
+  std::vector<Contour> out;
+  for (const CPath::Polyline &line : path.Flatten(tolerance_)) {
+    for (Contour &c : Stroke(line)) {
+      out.push_back(std::move(c));
+    }
+  }
+  return out;
+}
+
+std::vector<CStroker::Contour> CStroker::Stroke(const CPath::Polyline &line) const {
+  std::vector<Contour> out;
+  Contour pts;
+  for (const std::pair<double, double> &p : line.points) {
+    if (std::isfinite(p.first) && std::isfinite(p.second) && (pts.empty() || pts.back() != p)) {
+      pts.push_back(p);
+    }
+  }
+  if (line.closed && pts.size() > 1 && pts.front() == pts.back()) {
+    pts.pop_back();
+  }
+  if (half_width_ <= 0 || pts.size() < 2) {
+    return out;
+  }
+  if (line.closed && pts.size() > 2) {
+    Contour left, right;
+    OffsetSide(pts, true, 1, left);
+    OffsetSide(pts, true, -1, right);
+    std::reverse(right.begin(), right.end());
+    out.push_back(std::move(left));
+    out.push_back(std::move(right));
+    return out;
+  }
+
+  Contour left, right;
+  OffsetSide(pts, false, 1, left);
+  OffsetSide(pts, false, -1, right);
+  size_t n = pts.size();
+  double len = std::hypot(pts[n - 1].first - pts[n - 2].first, pts[n - 1].second - pts[n - 2].second);
+  AddCap(pts[n - 1].first, pts[n - 1].second, (pts[n - 1].first - pts[n - 2].first) / len,
+         (pts[n - 1].second - pts[n - 2].second) / len, left);
+  left.insert(left.end(), right.rbegin(), right.rend());
+  len = std::hypot(pts[1].first - pts[0].first, pts[1].second - pts[0].second);
+  AddCap(pts[0].first, pts[0].second, (pts[0].first - pts[1].first) / len,
+         (pts[0].second - pts[1].second) / len, left);
+  out.push_back(std::move(left));
+  return out;
+}
+
+void CStroker::OffsetSide(const Contour &points, bool closed, double side, Contour &out) const {
+  size_t n = points.size();
+  size_t segs = closed ? n : n - 1;
+  // Unit normals of every segment, pointing to this side
+  std::vector<std::pair<double, double>> normals(segs);
+  for (size_t i = 0; i < segs; i++) {
+    const std::pair<double, double> &a = points[i];
+    const std::pair<double, double> &b = points[(i + 1) % n];
+    double len = std::hypot(b.first - a.first, b.second - a.second);
+    normals[i] = {-(b.second - a.second) / len * side, (b.first - a.first) / len * side};
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    double px = points[i].first;
+    double py = points[i].second;
+    bool has_prev = closed || i > 0;
+    bool has_next = closed || i + 1 < n;
+    if (has_prev && has_next) {
+      const std::pair<double, double> &n0 = normals[(i + segs - 1) % segs];
+      const std::pair<double, double> &n1 = normals[i % segs];
+      // n0 x n1 is the turn of the path itself; this side is on the outside
+      // of the turn when the path bends away from it
+      double turn = (n0.first * n1.second - n0.second * n1.first) * side;
+      AddJoin(px, py, n0.first, n0.second, n1.first, n1.second, turn < 0, out);
+    } else {
+      const std::pair<double, double> &nn = normals[has_next ? i : i - 1];
+      out.emplace_back(px + nn.first * half_width_, py + nn.second * half_width_);
+    }
+  }
+}
+
+void CStroker::AddJoin(double px, double py, double n0x, double n0y, double n1x, double n1y,
+                       bool outer, Contour &out) const {
+  double hw = half_width_;
+  out.emplace_back(px + n0x * hw, py + n0y * hw);
+  double dot = n0x * n1x + n0y * n1y;
+  if (dot > 1 - 1e-12) {
+    return;
+  }
+  if (!outer) {
+    // Go through the vertex itself, the overlap is absorbed by nonzero filling
+    out.emplace_back(px, py);
+  } else if (join_ == ROUND_JOIN) {
+    AddArc(px, py, std::atan2(n0y, n0x), std::atan2(n0x * n1y - n0y * n1x, dot), out);
+    return;
+  } else if (join_ == MITER_JOIN) {
+    // The miter tip lies along the bisector at hw / cos(theta / 2)
+    double mx = n0x + n1x;
+    double my = n0y + n1y;
+    double m_len = std::hypot(mx, my);
+    double cos_half = m_len / 2;
+    if (m_len > 1e-12 && 1 / cos_half <= miter_limit_) {
+      double k = hw / (cos_half * m_len);
+      out.emplace_back(px + mx * k, py + my * k);
+    }
+  }
+  out.emplace_back(px + n1x * hw, py + n1y * hw);
+}
+
+void CStroker::AddCap(double px, double py, double dx, double dy, Contour &out) const {
+  // Goes from the side at the current end of out to the opposite one,
+  // bulging along (dx, dy)
+  double hw = half_width_;
+  double nx = out.back().first - px;
+  double ny = out.back().second - py;
+  if (cap_ == SQUARE_CAP) {
+    out.emplace_back(px + nx + dx * hw, py + ny + dy * hw);
+    out.emplace_back(px - nx + dx * hw, py - ny + dy * hw);
+  } else if (cap_ == ROUND_CAP) {
+    double sweep = nx * dy - ny * dx > 0 ? M_PI : -M_PI;
+    AddArc(px, py, std::atan2(ny, nx), sweep, out);
+  }
+}
+
+void CStroker::AddArc(double cx, double cy, double from, double sweep, Contour &out) const {
+  // Step so that the chord stays within the tolerance from the circle
+  double hw = half_width_;
+  double step = hw > tolerance_ ? 2 * std::acos(1 - tolerance_ / hw) : M_PI / 2;
+  int n = std::max(1, (int) std::ceil(std::abs(sweep) / step));
+  n = std::min(n, 1024);
+  for (int i = 1; i < n; i++) {
+    double a = from + sweep * i / n;
+    out.emplace_back(cx + std::cos(a) * hw, cy + std::sin(a) * hw);
+  }
+  out.emplace_back(cx + std::cos(from + sweep) * hw, cy + std::sin(from + sweep) * hw);
+}
@@ -0,0 +1,54 @@
+#ifndef COMPUTERGEOMETRY_GRAPHICS_CSTROKER_H
+#define COMPUTERGEOMETRY_GRAPHICS_CSTROKER_H
+
+#include <utility>
+#include <vector>
+
+#include "CPath.h"
+
+enum LineJoin {
+  MITER_JOIN,
+  ROUND_JOIN,
+  BEVEL_JOIN
+};
+
+enum LineCap {
+  BUTT_CAP,
+  SQUARE_CAP,
+  ROUND_CAP
+};
+
+// Turns a flattened path into fill contours of its stroke. An open subpath
+// becomes a single contour (left side, end cap, right side backwards, start
+// cap), a closed one becomes an outer and an inner ring of opposite
+// orientation. Inner joins pivot through the vertex, so the result is only
+// meant to be filled with the nonzero rule.
+class CStroker {
+ public:
+  typedef std::vector<std::pair<double, double>> Contour;
+
+  CStroker(double thickness, LineJoin join, LineCap cap, double miter_limit = 4.0,
+           double tolerance = 0.25);
+
+  std::vector<Contour> Stroke(const CPath &path) const;
+
+  std::vector<Contour> Stroke(const CPath::Polyline &line) const;
+
+ private:
+  double half_width_;
+  LineJoin join_;
+  LineCap cap_;
+  double miter_limit_;
+  double tolerance_;
+
+  void OffsetSide(const Contour &points, bool closed, double side, Contour &out) const;
+
+  void AddJoin(double px, double py, double n0x, double n0y, double n1x, double n1y,
+               bool outer, Contour &out) const;
+
+  void AddCap(double px, double py, double dx, double dy, Contour &out) const;
+
+  void AddArc(double cx, double cy, double from, double sweep, Contour &out) const;
+};
+
+#endif //COMPUTERGEOMETRY_GRAPHICS_CSTROKER_H
@@ -0,0 +1,87 @@
+#include "CThreadPool.h"
+
+CThreadPool::CThreadPool(int threads)
+    : job_(nullptr), job_size_(0), next_(0), pending_(0), generation_(0), stop_(false) {
+  if (threads <= 0) {
+    threads = DefaultThreadCount();
+  }
+  for (int i = 1; i < threads; i++) {
+    workers_.emplace_back(&CThreadPool::WorkerLoop, this);
+  }
+}
+
+CThreadPool::~CThreadPool() {
+  {
+    std::lock_guard<std::mutex> guard(lock_);
+    stop_ = true;
+  }
+  wake_.notify_all();
+  for (std::thread &worker : workers_) {
+    worker.join();
+  }
+}
+
+int CThreadPool::GetThreadCount() const {
+  return (int) workers_.size() + 1;
+}
+
+int CThreadPool::DefaultThreadCount() {
+  int n = (int) std::thread::hardware_concurrency();
+  return n > 0 ? n : 1;
+}
+
+void CThreadPool::ParallelFor(int n, const std::function<void(int)> &fn) {
+  if (n <= 0) {
+    return;
+  }
+  std::unique_lock<std::mutex> guard(lock_);
+  job_ = &fn;
+  job_size_ = n;
+  next_ = 0;
+  pending_ = n;
+  error_ = nullptr;
+  generation_++;
+  wake_.notify_all();
+  RunJob(guard);
+  done_.wait(guard, [this] { return pending_ == 0; });
+  job_ = nullptr;
+  if (error_) {
+    std::exception_ptr error = error_;
+    error_ = nullptr;
+    std::rethrow_exception(error);
+  }
+}
+
+void CThreadPool::WorkerLoop() {
+  int seen = 0;
+  std::unique_lock<std::mutex> guard(lock_);
+  while (true) {
+    wake_.wait(guard, [&] { return stop_ || generation_ != seen; });
+    if (stop_) {
+      return;
+    }
+    seen = generation_;
+    RunJob(guard);
+  }
+}
+
+void CThreadPool::RunJob(std::unique_lock<std::mutex> &guard) {
+  while (job_ && next_ < job_size_) {
+    int i = next_++;
+    const std::function<void(int)> &fn = *job_;
+    guard.unlock();
+    try {
+      fn(i);
+    } catch (...) {
+      guard.lock();
+      if (!error_) {
+        error_ = std::current_exception();
+      }
+      guard.unlock();
+    }
+    guard.lock();
+    if (--pending_ == 0) {
+      done_.notify_all();
+    }
+  }
+}
@@ -0,0 +1,43 @@
+#ifndef COMPUTERGEOMETRY_GRAPHICS_CTHREADPOOL_H
+#define COMPUTERGEOMETRY_GRAPHICS_CTHREADPOOL_H
+
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads running index loops. ParallelFor blocks until
+// every index has been processed; the calling thread takes part in the work.
+class CThreadPool {
+ public:
+  explicit CThreadPool(int threads = 0);
+
+  ~CThreadPool();
+
+  int GetThreadCount() const;
+
+  void ParallelFor(int n, const std::function<void(int)> &fn);
+
+  static int DefaultThreadCount();
+
+ private:
+  std::vector<std::thread> workers_;
+  std::mutex lock_;
+  std::condition_variable wake_;
+  std::condition_variable done_;
+  const std::function<void(int)> *job_;
+  int job_size_;
+  int next_;
+  int pending_;
+  int generation_;
+  bool stop_;
+  std::exception_ptr error_;
+
+  void WorkerLoop();
+
+  void RunJob(std::unique_lock<std::mutex> &guard);
+};
+
+#endif //COMPUTERGEOMETRY_GRAPHICS_CTHREADPOOL_H
@@ -4,6 +4,7 @@
 #include <iostream>
 #include <cmath>
 #include "CImage.cpp"
+#include "CFrameRenderer.h"
 
 int main() {
   try {
@@ -11,17 +12,43 @@ int main() {
     double y0 = 200;
     double len = 100;
     double gamma = 2.2;
-    for (double deg = 0; deg < 360; deg += 1.0) {
-      CImage<CMonoPixel> img("img/test.pgm");
+    CCoverageMaskCache cache;
+    CFont font;
+    // Frames only depend on the angle, so they are rendered in parallel and
+    // appended in order to one multi-image PGM
+    CImage<CMonoPixel> background("img/test.pgm");
+    FILE *out = fopen("img/out.pgm", "wb");
+    if (!out) {
+      throw CImageFileOpenException();
+    }
+    CFrameRenderer<CMonoPixel> renderer(background);
+    renderer.Render(360, [&](int frame, CImage<CMonoPixel> &img) {
+      double deg = frame;
       double x1 = x0 + len * cos(deg * 3.1415 / 180.0);
       double y1 = y0 - len * sin(deg * 3.1415 / 180.0);
+      img.SetMaskCache(&cache);
+      img.fillArc(128, x0, y0, len, len, 0, deg, gamma);
+      img.drawCircle(255, 3, x0, y0, len, gamma);
+      // Gauge ticks are the same strokes every frame, so they come from the cache
+      for (int tick = 0; tick < 60; tick++) {
+        double a = tick * 6 * 3.1415 / 180.0;
+        double inner = len + (tick % 5 == 0 ? 6 : 10);
+        img.drawLine(255, tick % 5 == 0 ? 4 : 2, x0 + inner * cos(a), y0 - inner * sin(a),
+                     x0 + (len + 18) * cos(a), y0 - (len + 18) * sin(a), gamma);
+      }
       img.drawLine(255, 50, x0, y0, x1, y1, gamma);
-      img.writeImg("img/out" + std::to_string((int) deg) + ".pgm");
-      std::system(("magick convert img/out" + std::to_string((int) deg) + ".pgm img/out" + std::to_string((int) deg)
-          + ".png").c_str());
-      std::cout << std::to_string(deg) << std::endl;
+      img.drawText(font, "frame " + std::to_string(frame) + "\n" + std::to_string(frame) + " deg",
+                   8, 8, 255, gamma, 2);
+    }, [&](int frame, CImage<CMonoPixel> &img) {
+      img.writeImg(out);
+      std::cout << frame << std::endl;
+    });
+    if (fclose(out) != 0) {
+      throw CImageFileWriteException();
     }
-    std::system("magick convert img/out{0..359}.png img/out.gif");
+    std::system("magick convert img/out.pgm img/out.gif");
+    std::cout << "mask cache: " << cache.GetHits() << " hits, " << cache.GetMisses() << " misses"
+              << std::endl;
   } catch (CImageException e) {
     std::cerr << e.getErr() << std::endl;
   }
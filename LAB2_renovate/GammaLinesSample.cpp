@@ -10,6 +10,21 @@ int main() {
     int bright = 180;
     img.drawLine(bright, 25, 0, 25, 100, 0, 2.2);
     img.drawLine(bright, 25, 0, 75, 100, 50, 1);
+    img.drawLine(bright, 1, 0, 5, 100, 45, 2.2);
+    img.drawLine(bright, 1, 0, 55, 100, 95, 1);
+    CPath path;
+    path.MoveTo(5, 95);
+    path.CubicTo(30, 10, 70, 10, 95, 95);
+    path.QuadTo(50, 60, 5, 95);
+    path.Close();
+    img.drawPath(path, bright, 3, ROUND_JOIN, ROUND_CAP, 2.2);
+    img.drawPolyline({{10, 10}, {30, 40}, {50, 10}, {70, 40}, {90, 10}}, bright, 4, MITER_JOIN,
+                     SQUARE_CAP, 2.2);
+    // A square with a square hole, then two overlapping squares kept apart by even-odd
+    img.fillPolygons({{{60, 60}, {95, 60}, {95, 95}, {60, 95}}, {{70, 70}, {70, 85}, {85, 85}, {85, 70}}},
+                     bright, NON_ZERO, 2.2);
+    img.fillPolygons({{{5, 60}, {35, 60}, {35, 90}, {5, 90}}, {{20, 75}, {50, 75}, {50, 98}, {20, 98}}},
+                     bright, EVEN_ODD, 2.2);
     img.writeImg("out.pgm");
   } catch (CImageException e) {
     std::cerr << e.getErr();
@@ -2,33 +2,140 @@
 // Created by @mikhirurg on 11.04.2020.
 //
 #include <iostream>
+#include <fstream>
+#include <sstream>
 #include "CImage.cpp"
 
-int main(int argc, char *argv[]) {
-  try {
-    if (argc != 10 && argc != 9) {
+// A whole decimal value in 0..255
+uchar ParseLevel(const std::string &str) {
+  if (str.empty() || str.size() > 3 || str.find_first_not_of("0123456789") != std::string::npos) {
+    throw CImageParamsException();
+  }
+  int v = std::stoi(str);
+  if (v > 255) {
+    throw CImageParamsException();
+  }
+  return (uchar) v;
+}
+
+// "v" for grey, "r,g,b" for a color on P6 images; anything else is rejected
+void ParseColor(const std::string &str, CMonoPixel &color) {
+  color.val = ParseLevel(str);
+}
+
+void ParseColor(const std::string &str, CColorPixel &color) {
+  size_t first = str.find(',');
+  if (first == std::string::npos) {
+    uchar v = ParseLevel(str);
+    color = {v, v, v};
+    return;
+  }
+  size_t second = str.find(',', first + 1);
+  if (second == std::string::npos) {
+    throw CImageParamsException();
+  }
+  color = {ParseLevel(str.substr(0, first)),
+           ParseLevel(str.substr(first + 1, second - first - 1)),
+           ParseLevel(str.substr(second + 1))};
+}
+
+// Scene file: one line per stroke, "color thickness x1 y1 x2 y2" with the
+// color as on the command line; blank lines and lines starting with '#' are
+// skipped
+template<class T>
+std::vector<CLineSpec<T>> ReadScene(const std::string &fname) {
+  std::ifstream in(fname);
+  if (!in) {
+    throw CImageFileOpenException();
+  }
+  std::vector<CLineSpec<T>> lines;
+  std::string str;
+  while (std::getline(in, str)) {
+    size_t first = str.find_first_not_of(" \t\r");
+    if (first == std::string::npos || str[first] == '#') {
+      continue;
+    }
+    std::istringstream line(str);
+    std::string color;
+    CLineSpec<T> spec;
+    if (!(line >> color >> spec.thickness >> spec.x1 >> spec.y1 >> spec.x2 >> spec.y2)) {
       throw CImageParamsException();
     }
-    CImage<CMonoPixel> img = CImage<CMonoPixel>(argv[1]);
-    int brightness;
-    double thickness, x1, y1, x2, y2, gamma;
     try {
-      brightness = std::stoi(argv[3]);
-      thickness = std::stod(argv[4]);
-      x1 = std::stod(argv[5]);
-      y1 = std::stod(argv[6]);
-      x2 = std::stod(argv[7]);
-      y2 = std::stod(argv[8]);
-      if (argc == 10) {
-        gamma = std::stod(argv[9]);
-      } else {
-        gamma = 2.2;
+      ParseColor(color, spec.color);
+    } catch (std::logic_error &) {
+      throw CImageParamsException();
+    }
+    lines.push_back(spec);
+  }
+  return lines;
+}
+
+bool IsColorImage(const std::string &fname) {
+  FILE *f = fopen(fname.c_str(), "rb");
+  if (!f) {
+    throw CImageFileOpenException();
+  }
+  int type = 0;
+  int n = fscanf(f, "P%i", &type);
+  fclose(f);
+  return n == 1 && type == P6;
+}
+
+template<class T>
+void Run(int argc, char *argv[]) {
+  if (argc >= 4 && std::string(argv[3]) == "--scene") {
+    if (argc != 5 && argc != 6) {
+      throw CImageParamsException();
+    }
+    CImage<T> img = CImage<T>(argv[1]);
+    double gamma = 2.2;
+    try {
+      if (argc == 6) {
+        gamma = std::stod(argv[5]);
       }
-    } catch (std::invalid_argument &) {
+    } catch (std::logic_error &) {
       throw CImageParamsException();
     }
-    img.drawLine(brightness, thickness, x1, y1, x2, y2, gamma);
+    img.drawLines(ReadScene<T>(argv[4]), gamma);
     img.writeImg(argv[2]);
+    return;
+  }
+  if (argc != 10 && argc != 9) {
+    throw CImageParamsException();
+  }
+  CImage<T> img = CImage<T>(argv[1]);
+  T color;
+  double thickness, x1, y1, x2, y2, gamma;
+  try {
+    ParseColor(argv[3], color);
+    thickness = std::stod(argv[4]);
+    x1 = std::stod(argv[5]);
+    y1 = std::stod(argv[6]);
+    x2 = std::stod(argv[7]);
+    y2 = std::stod(argv[8]);
+    if (argc == 10) {
+      gamma = std::stod(argv[9]);
+    } else {
+      gamma = 2.2;
+    }
+  } catch (std::logic_error &) {
+    throw CImageParamsException();
+  }
+  img.drawLine(color, thickness, x1, y1, x2, y2, gamma);
+  img.writeImg(argv[2]);
+}
+
+int main(int argc, char *argv[]) {
+  try {
+    if (argc < 2) {
+      throw CImageParamsException();
+    }
+    if (IsColorImage(argv[1])) {
+      Run<CColorPixel>(argc, argv);
+    } else {
+      Run<CMonoPixel>(argc, argv);
+    }
   } catch (CImageException e) {
     std::cerr << e.getErr() << std::endl;
     return 1;
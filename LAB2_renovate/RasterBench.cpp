@@ -0,0 +1,345 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <chrono>
+#include <functional>
+#include <random>
+#include "CImage.cpp"
+
+// Rasterizer benchmarks and golden-image regression check.
+//   RasterBench compare [count]   polygon vs distance strokes, thickness 1..200
+//   RasterBench sweep [--quick]   thickness x angle x length x gamma x canvas
+//   RasterBench golden <dir> [--update] [--psnr dB] [--max-err n]
+// The golden check asks for an exact match unless loosened by the options,
+// and also checks that files kept up to date with writeChangedRows match
+// whole writes of the same frames (written to the working directory).
+// Without arguments runs compare and a quick sweep.
+
+double Seconds(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+struct BenchResult {
+  double us_per_line;
+  double area_error;
+};
+
+// Area error is against the exact stroke area (square caps for the polygon
+// path, round caps for the distance path)
+BenchResult Compare(StrokeMethod method, double thickness, const std::vector<LineSpec> &lines,
+                    int size) {
+  CImage<CMonoPixel> img(size, size, 255, P5);
+  auto start = std::chrono::steady_clock::now();
+  for (const LineSpec &line : lines) {
+    img.drawLine(line.color, thickness, line.x1, line.y1, line.x2, line.y2, 1.0, method);
+  }
+  double seconds = Seconds(start);
+
+  // Area is measured on one isolated line in the middle of the canvas
+  CImage<CMonoPixel> one(size, size, 255, P5);
+  double len = size / 4.0;
+  one.drawLine(255, thickness, size / 2.0 - len / 2, size / 2.0, size / 2.0 + len / 2,
+               size / 2.0 + len / 3, 1.0, method);
+  double area = 0;
+  for (int y = 0; y < size; y++) {
+    for (int x = 0; x < size; x++) {
+      area += one[y][x].val / 255.0;
+    }
+  }
+  double l = std::hypot(len, len / 3);
+  double exact = method == DISTANCE_STROKE ? l * thickness + M_PI * thickness * thickness / 4
+                                           : (l + thickness) * thickness;
+  return {seconds * 1e6 / lines.size(), area / exact - 1};
+}
+
+void RunCompare(int count) {
+  int size = 1024;
+  std::mt19937 rng(1);
+  std::uniform_real_distribution<double> coord(0, size);
+  std::vector<LineSpec> lines(count);
+  for (LineSpec &line : lines) {
+    line = {255, 0, coord(rng), coord(rng), coord(rng), coord(rng)};
+  }
+
+  std::cout << "thickness  polygon us/line  area err   distance us/line  area err  speedup"
+            << std::endl;
+  for (double thickness : {1.0, 1.5, 2.0, 3.0, 5.0, 8.0, 12.0, 20.0, 35.0, 50.0, 75.0, 100.0,
+                           150.0, 200.0}) {
+    BenchResult polygon = Compare(SUPERSAMPLED_STROKE, thickness, lines, size);
+    BenchResult distance = Compare(DISTANCE_STROKE, thickness, lines, size);
+    std::cout << std::fixed << std::setprecision(1) << std::setw(9) << thickness
+              << std::setw(17) << polygon.us_per_line
+              << std::setprecision(4) << std::setw(10) << polygon.area_error
+              << std::setprecision(1) << std::setw(19) << distance.us_per_line
+              << std::setprecision(4) << std::setw(10) << distance.area_error
+              << std::setprecision(2) << std::setw(9) << polygon.us_per_line / distance.us_per_line
+              << std::endl;
+  }
+}
+
+// Draws lines of one shape at random positions until the time budget is
+// spent; ns/pixel is per pixel of stroke area (length x max(thickness, 1))
+void RunSweep(bool quick) {
+  std::vector<double> thicknesses = {1, 2, 5, 20, 100};
+  std::vector<double> angles = {0, 15, 45, 80};
+  std::vector<double> lengths = {10, 100, 500};
+  std::vector<double> gammas = {1.0, 2.2};
+  std::vector<int> sizes = {256, 1024, 4096};
+  double budget = 0.02;
+  if (quick) {
+    thicknesses = {1, 5, 50};
+    angles = {0, 30};
+    lengths = {20, 300};
+    gammas = {2.2};
+    sizes = {512};
+    budget = 0.01;
+  }
+
+  std::cout << "method      canvas  thick  angle  length  gamma     lines/s    ns/pixel" << std::endl;
+  std::mt19937 rng(2);
+  for (int size : sizes) {
+    CImage<CMonoPixel> img(size, size, 255, P5);
+    std::uniform_real_distribution<double> coord(0, size);
+    for (StrokeMethod method : {SUPERSAMPLED_STROKE, DISTANCE_STROKE}) {
+      for (double thickness : thicknesses) {
+        for (double angle : angles) {
+          for (double length : lengths) {
+            for (double gamma : gammas) {
+              double dx = length * cos(angle * M_PI / 180);
+              double dy = length * sin(angle * M_PI / 180);
+              long lines = 0;
+              auto start = std::chrono::steady_clock::now();
+              double elapsed;
+              do {
+                double x = coord(rng);
+                double y = coord(rng);
+                img.drawLine(200, thickness, x - dx / 2, y - dy / 2, x + dx / 2, y + dy / 2, gamma,
+                             method);
+                lines++;
+              } while ((elapsed = Seconds(start)) < budget);
+              double pixels = lines * length * std::max(thickness, 1.0);
+              std::cout << std::left << std::setw(10)
+                        << (method == DISTANCE_STROKE ? "distance" : "polygon") << std::right
+                        << std::setw(8) << size
+                        << std::fixed << std::setprecision(0) << std::setw(7) << thickness
+                        << std::setw(7) << angle << std::setw(8) << length
+                        << std::setprecision(1) << std::setw(7) << gamma
+                        << std::setprecision(0) << std::setw(12) << lines / elapsed
+                        << std::setprecision(2) << std::setw(12) << elapsed * 1e9 / pixels
+                        << std::endl;
+            }
+          }
+        }
+      }
+    }
+  }
+}
+
+// Golden scenes exercise every rasterizer path on a gradient background
+void Background(CImage<CMonoPixel> &img) {
+  for (int y = 0; y < img.GetHeight(); y++) {
+    for (int x = 0; x < img.GetWidth(); x++) {
+      img[y][x].val = (uchar) (x * 255 / img.GetWidth() / 2 + y * 255 / img.GetHeight() / 4);
+    }
+  }
+}
+
+void SceneThick(CImage<CMonoPixel> &img) {
+  Background(img);
+  for (int i = 0; i < 12; i++) {
+    double a = i * M_PI / 12;
+    img.drawLine(230, 1.5 + i * 1.7, 96 + 20 * cos(a), 96 + 20 * sin(a), 96 + 90 * cos(a),
+                 96 + 90 * sin(a), 2.2);
+  }
+  img.drawLine(40, 9, -20, 150, 210, 185, 1.0);
+}
+
+void SceneThin(CImage<CMonoPixel> &img) {
+  Background(img);
+  for (int i = 0; i < 24; i++) {
+    double a = i * M_PI / 12 + 0.1;
+    img.drawLine(255, i % 3 == 0 ? 0.5 : 1, 96, 96, 96 + 95 * cos(a), 96 + 95 * sin(a),
+                 i % 2 ? 2.2 : 1.0);
+  }
+}
+
+void SceneBatch(CImage<CMonoPixel> &img) {
+  Background(img);
+  std::vector<LineSpec> lines;
+  for (int i = 0; i < 40; i++) {
+    lines.push_back({(uchar) (i % 2 ? 250 : 20), 2.0 + i % 5 * 2, 5.0 + i * 4.5, 5, 190 - i * 4.0,
+                     187});
+  }
+  img.drawLines(lines, 2.2, 2);
+}
+
+void SceneShapes(CImage<CMonoPixel> &img) {
+  Background(img);
+  img.fillCircle(200, 60, 60, 40.5, 2.2);
+  img.drawEllipse(255, 3, 130, 70, 50, 25, 2.2);
+  img.drawArc(30, 6, 96, 130, 70, 50, 200, 340, 2.2);
+  img.fillArc(160, 150, 150, 35, 35, 45, 300, 2.2);
+  CPath path;
+  path.MoveTo(10, 180);
+  path.CubicTo(60, 100, 120, 250, 185, 120);
+  img.drawPath(path, 240, 4, ROUND_JOIN, ROUND_CAP, 2.2);
+  img.drawPolyline({{10, 20}, {40, 60}, {70, 15}, {100, 60}}, 10, 6, MITER_JOIN, SQUARE_CAP, 2.2);
+  img.drawLine(255, 14, 20, 110, 180, 170, 2.2, DISTANCE_STROKE);
+}
+
+void SceneColor(CImage<CColorPixel> &img) {
+  for (int y = 0; y < img.GetHeight(); y++) {
+    for (int x = 0; x < img.GetWidth(); x++) {
+      img[y][x] = {(uchar) x, (uchar) y, 90};
+    }
+  }
+  img.drawLine({255, 40, 40}, 12, 10, 10, 180, 150, 2.2);
+  img.drawLine({40, 255, 40}, 1, 10, 180, 180, 20, 2.2);
+  img.drawLine({40, 40, 255}, 7, 100, 5, 110, 190, 2.2, DISTANCE_STROKE);
+  img.BeginLinear(2.2);
+  img.fillCircle(220, 140, 140, 30, 2.2);
+  img.drawLine({250, 250, 0}, 5, 20, 100, 190, 110, 2.2);
+  img.EndLinear();
+}
+
+template<class T>
+bool CheckGolden(const std::string &dir, const std::string &name, FileType type,
+                 const std::function<void(CImage<T> &)> &scene, bool update, double min_psnr,
+                 int max_err) {
+  const int size = 192;
+  CImage<T> img(size, size, 255, type);
+  scene(img);
+  std::string fname = dir + "/" + name + (type == P5 ? ".pgm" : ".ppm");
+  if (update) {
+    img.writeImg(fname);
+    std::cout << "wrote " << fname << std::endl;
+    return true;
+  }
+  CImage<T> golden(fname);
+  if (golden.GetWidth() != size || golden.GetHeight() != size) {
+    std::cout << name << ": FAIL, golden size differs" << std::endl;
+    return false;
+  }
+  int err = 0;
+  double sum_sq = 0;
+  long samples = 0;
+  for (int y = 0; y < size; y++) {
+    auto *a = (const uchar *) img[y];
+    auto *b = (const uchar *) golden[y];
+    for (int i = 0; i < size * (int) sizeof(T); i++) {
+      int d = std::abs(a[i] - b[i]);
+      err = std::max(err, d);
+      sum_sq += d * d;
+      samples++;
+    }
+  }
+  double mse = sum_sq / samples;
+  double psnr = mse > 0 ? 10 * log10(255.0 * 255.0 / mse) : INFINITY;
+  bool ok = psnr >= min_psnr && err <= max_err;
+  std::cout << std::left << std::setw(8) << name << std::right << (ok ? "  PASS" : "  FAIL")
+            << "  psnr " << std::fixed << std::setprecision(2) << psnr << " dB  max err " << err
+            << std::endl;
+  return ok;
+}
+
+std::string ReadFile(const std::string &fname) {
+  std::ifstream in(fname, std::ios::binary);
+  std::stringstream content;
+  content << in.rdbuf();
+  return content.str();
+}
+
+// Moves shapes over a background frame by frame, saving each frame with
+// writeChangedRows and comparing the file against a whole writeImg. One
+// frame goes to another file first, which forces a whole rewrite, and one is
+// drawn and saved while the linear canvas is open
+bool CheckChangedRows() {
+  const int size = 192, frames = 12;
+  const std::string partial = "changed_rows.pgm", other = "changed_rows_other.pgm",
+      full = "changed_rows_full.pgm";
+  CImage<CMonoPixel> background(size, size, 255, P5);
+  Background(background);
+  CImage<CMonoPixel> img(background);
+  img.TrackDirty(true);
+  int mismatch = 0;
+  for (int i = 0; i < frames; i++) {
+    img.RestoreDirty(background);
+    bool linear = i == frames - 2;
+    if (linear) {
+      img.BeginLinear(2.2);
+    }
+    img.fillCircle(220, 30 + i * 12, 60 + i * 5, 20, 2.2);
+    img.drawLine(40, 3, 10, 10 + i * 14, 180, 100, 2.2);
+    img.PutPixel(i * 7, 150, {255});
+    if (i == frames / 2) {
+      img.writeChangedRows(other);
+    }
+    img.writeChangedRows(partial);
+    img.writeImg(full);
+    if (linear) {
+      img.EndLinear();
+    }
+    mismatch += ReadFile(partial) != ReadFile(full);
+  }
+  remove(partial.c_str());
+  remove(other.c_str());
+  remove(full.c_str());
+  bool ok = mismatch == 0;
+  std::cout << std::left << std::setw(8) << "changed" << std::right << (ok ? "  PASS" : "  FAIL")
+            << "  " << mismatch << " of " << frames << " frames differ" << std::endl;
+  return ok;
+}
+
+int RunGolden(const std::string &dir, bool update, double min_psnr, int max_err) {
+  bool ok = true;
+  ok &= CheckGolden<CMonoPixel>(dir, "thick", P5, SceneThick, update, min_psnr, max_err);
+  ok &= CheckGolden<CMonoPixel>(dir, "thin", P5, SceneThin, update, min_psnr, max_err);
+  ok &= CheckGolden<CMonoPixel>(dir, "batch", P5, SceneBatch, update, min_psnr, max_err);
+  ok &= CheckGolden<CMonoPixel>(dir, "shapes", P5, SceneShapes, update, min_psnr, max_err);
+  ok &= CheckGolden<CColorPixel>(dir, "color", P6, SceneColor, update, min_psnr, max_err);
+  if (!update) {
+    ok &= CheckChangedRows();
+  }
+  return ok ? 0 : 1;
+}
+
+int main(int argc, char *argv[]) {
+  try {
+    std::string mode = argc > 1 ? argv[1] : "";
+    if (mode.empty()) {
+      RunCompare(100);
+      RunSweep(true);
+    } else if (mode == "compare") {
+      RunCompare(argc > 2 ? std::stoi(argv[2]) : 200);
+    } else if (mode == "sweep") {
+      RunSweep(argc > 2 && std::string(argv[2]) == "--quick");
+    } else if (mode == "golden" && argc > 2) {
+      bool update = false;
+      double min_psnr = 0;
+      int max_err = 0;
+      for (int i = 3; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--update") {
+          update = true;
+        } else if (arg == "--psnr" && i + 1 < argc) {
+          min_psnr = std::stod(argv[++i]);
+        } else if (arg == "--max-err" && i + 1 < argc) {
+          max_err = std::stoi(argv[++i]);
+        } else {
+          throw CImageParamsException();
+        }
+      }
+      return RunGolden(argv[2], update, min_psnr, max_err);
+    } else {
+      throw CImageParamsException();
+    }
+  } catch (CImageException &e) {
+    std::cerr << e.getErr() << std::endl;
+    return 1;
+  } catch (std::invalid_argument &) {
+    std::cerr << CImageParamsException().getErr() << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -58,14 +58,20 @@ struct ErrorDiffMatrix {
   }
 };
 
+// Error diffused ahead of the current row. The kernels reach at most two
+// rows down, so only ROWS rows are kept: row y lives in slot y % ROWS, and
+// NextRow clears the slot of a finished row for reuse. DoErrorDiffDithering
+// rejects matrices reaching further down, and error aimed at finished rows
+// above is dropped, as nothing would read it.
 struct GrayCompensationBuffer {
+  static const int ROWS = 3;
   double *buffer_;
   int w_, h_;
 
   GrayCompensationBuffer(int w, int h)
       : w_(w), h_(h) {
-    buffer_ = new double[w_ * h_];
-    for (int i = 0; i < w_ * h_; i++) {
+    buffer_ = new double[w_ * ROWS];
+    for (int i = 0; i < w_ * ROWS; i++) {
       buffer_[i] = 0.0f;
     }
   }
@@ -74,17 +80,21 @@ struct GrayCompensationBuffer {
     delete[] buffer_;
   }
   double Get(int x, int y) const {
-    return buffer_[y * w_ + x];
+    return buffer_[(y % ROWS) * w_ + x];
   }
   void Add(int x, int y, double val) {
-    buffer_[y * w_ + x] += val;
+    buffer_[(y % ROWS) * w_ + x] += val;
   }
   void Set(int x, int y, double val) {
-    buffer_[y * w_ + x] = val;
+    buffer_[(y % ROWS) * w_ + x] = val;
+  }
+  void NextRow(int y) {
+    std::fill(buffer_ + (y % ROWS) * w_, buffer_ + (y % ROWS + 1) * w_, 0.0);
   }
 };
 
 struct ColorCompensationBuffer {
+  static const int ROWS = 3;
   double *buffer_r_;
   double *buffer_g_;
   double *buffer_b_;
@@ -92,10 +102,10 @@ struct ColorCompensationBuffer {
 
   ColorCompensationBuffer(int w, int h)
       : w_(w), h_(h) {
-    buffer_r_ = new double[w_ * h_];
-    buffer_g_ = new double[w_ * h_];
-    buffer_b_ = new double[w_ * h_];
-    for (int i = 0; i < w_ * h_; i++) {
+    buffer_r_ = new double[w_ * ROWS];
+    buffer_g_ = new double[w_ * ROWS];
+    buffer_b_ = new double[w_ * ROWS];
+    for (int i = 0; i < w_ * ROWS; i++) {
       buffer_r_[i] = 0.0f;
       buffer_g_[i] = 0.0f;
       buffer_b_[i] = 0.0f;
@@ -108,25 +118,34 @@ struct ColorCompensationBuffer {
     delete[] buffer_b_;
   }
   double GetR(int x, int y) const {
-    return buffer_r_[y * w_ + x];
+    return buffer_r_[(y % ROWS) * w_ + x];
   }
   double GetG(int x, int y) const {
-    return buffer_g_[y * w_ + x];
+    return buffer_g_[(y % ROWS) * w_ + x];
   }
   double GetB(int x, int y) const {
-    return buffer_b_[y * w_ + x];
+    return buffer_b_[(y % ROWS) * w_ + x];
   }
 
   void Add(int x, int y, double val_r, double val_g, double val_b) {
-    buffer_r_[y * w_ + x] += val_r;
-    buffer_g_[y * w_ + x] += val_g;
-    buffer_b_[y * w_ + x] += val_b;
+    int i = (y % ROWS) * w_ + x;
+    buffer_r_[i] += val_r;
+    buffer_g_[i] += val_g;
+    buffer_b_[i] += val_b;
   }
 
   void Set(int x, int y, double val_r, double val_g, double val_b) {
-    buffer_r_[y * w_ + x] = val_r;
-    buffer_g_[y * w_ + x] = val_g;
-    buffer_b_[y * w_ + x] = val_b;
+    int i = (y % ROWS) * w_ + x;
+    buffer_r_[i] = val_r;
+    buffer_g_[i] = val_g;
+    buffer_b_[i] = val_b;
+  }
+
+  void NextRow(int y) {
+    int i = (y % ROWS) * w_;
+    std::fill(buffer_r_ + i, buffer_r_ + i + w_, 0.0);
+    std::fill(buffer_g_ + i, buffer_g_ + i + w_, 0.0);
+    std::fill(buffer_b_ + i, buffer_b_ + i + w_, 0.0);
   }
 };
 
@@ -176,6 +195,10 @@ class CDitherer {
   T ModifyPixelByMap(T pixel, int x, int y, const SampleBayer &bayer, int n);
   T ModifyPixelByRandom(T pixel, int n, int seed);
   std::mt19937 rand;
+  // The row being dithered in linear light, one float array per channel;
+  // algorithms read and overwrite it in place and encode it once per row
+  std::vector<float> row_;
+  float *rows_[3];
 };
 template<>
 CMonoPixel CDitherer<CMonoPixel>::ModifyPixelByMap(CMonoPixel pixel, int x, int y, const SampleBayer &bayer, int n) {
@@ -286,6 +309,10 @@ CDitherer<T>::CDitherer(CImage<T> &img)
 
   HALFTONE_ORTHOGONAL += -0.5;
 
+  row_.resize((size_t) img_.GetWidth() * img_.GetChannels());
+  for (int c = 0; c < img_.GetChannels(); c++) {
+    rows_[c] = row_.data() + (size_t) c * img_.GetWidth();
+  }
 }
 template<class T>
 CDitherer<T>::~CDitherer() {
@@ -298,7 +325,7 @@ void CDitherer<T>::ApplyErrorDiffMatrix(const ErrorDiffMatrix &matrix, int x, in
     for (int j = 0; j < matrix.w_; j++) {
       int x1 = x + j - matrix.x0_;
       int y1 = y + i - matrix.y0_;
-      if (matrix.Get(j, i) > 0 && x1 >= 0 && x1 < img_.GetWidth() && y1 >= 0 && y1 < img_.GetHeight()) {
+      if (matrix.Get(j, i) > 0 && x1 >= 0 && x1 < img_.GetWidth() && y1 >= y && y1 < img_.GetHeight()) {
         gray_buffer.Add(x1, y1, float(err * matrix.Get(j, i) / double(matrix.del_)));
       }
     }
@@ -317,7 +344,7 @@ void CDitherer<CColorPixel>::ApplyErrorDiffMatrix(const ErrorDiffMatrix &matrix,
     for (int j = 0; j < matrix.w_; j++) {
       int x1 = x + j - matrix.x0_;
       int y1 = y + i - matrix.y0_;
-      if (matrix.Get(j, i) > 0 && x1 >= 0 && x1 < img_.GetWidth() && y1 >= 0 && y1 < img_.GetHeight()) {
+      if (matrix.Get(j, i) > 0 && x1 >= 0 && x1 < img_.GetWidth() && y1 >= y && y1 < img_.GetHeight()) {
         color_buffer.Add(x1,
                          y1,
                          double(err_r * matrix.Get(j, i) / double(matrix.del_)),
@@ -330,85 +357,112 @@ void CDitherer<CColorPixel>::ApplyErrorDiffMatrix(const ErrorDiffMatrix &matrix,
 
 template<>
 void CDitherer<CMonoPixel>::DoColorBitCorrection(int n) {
+  float *lin = rows_[0];
   for (int y = 0; y < img_.GetHeight(); y++) {
+    img_.LinearizeRow(y, rows_);
     for (int x = 0; x < img_.GetWidth(); x++) {
-      img_.PutPixelWithGamma(x, y, FindNearestPaletteColor(img_.GetLinearVal(x, y), n));
+      lin[x] = FindNearestPaletteColor(lin[x], n);
     }
+    img_.EncodeRow(y, rows_);
   }
 }
 
 template<>
 void CDitherer<CColorPixel>::DoColorBitCorrection(int n) {
+  float *lin_r = rows_[0];
+  float *lin_g = rows_[1];
+  float *lin_b = rows_[2];
   for (int y = 0; y < img_.GetHeight(); y++) {
+    img_.LinearizeRow(y, rows_);
     for (int x = 0; x < img_.GetWidth(); x++) {
-      double pixel_r = img_.GetLinearRVal(x, y);
-      double pixel_g = img_.GetLinearGVal(x, y);
-      double pixel_b = img_.GetLinearBVal(x, y);
-      img_.PutPixelWithGamma(x, y, FindNearestPaletteColor(pixel_r, n),
-                             FindNearestPaletteColor(pixel_g, n),
-                             FindNearestPaletteColor(pixel_b, n));
+      lin_r[x] = FindNearestPaletteColor(lin_r[x], n);
+      lin_g[x] = FindNearestPaletteColor(lin_g[x], n);
+      lin_b[x] = FindNearestPaletteColor(lin_b[x], n);
     }
+    img_.EncodeRow(y, rows_);
   }
 }
 
 template<>
 void CDitherer<CMonoPixel>::DoOrderedDithering(const SampleBayer &bayer, int n) {
+  float *lin = rows_[0];
   for (int y = 0; y < img_.GetHeight(); y++) {
+    img_.LinearizeRow(y, rows_);
     for (int x = 0; x < img_.GetWidth(); x++) {
-      CMonoPixel p = CMonoPixel{uchar(round(img_.GetLinearVal(x, y)))};
+      CMonoPixel p = CMonoPixel{uchar(round(lin[x]))};
       CMonoPixel pixel = ModifyPixelByMap(p, x, y, bayer, n);
-      img_.PutPixelWithGamma(x, y, pixel.val);
+      lin[x] = pixel.val;
     }
+    img_.EncodeRow(y, rows_);
   }
 }
 
 template<>
 void CDitherer<CColorPixel>::DoOrderedDithering(const SampleBayer &bayer, int n) {
+  float *lin_r = rows_[0];
+  float *lin_g = rows_[1];
+  float *lin_b = rows_[2];
   for (int y = 0; y < img_.GetHeight(); y++) {
+    img_.LinearizeRow(y, rows_);
     for (int x = 0; x < img_.GetWidth(); x++) {
-      CColorPixel p = CColorPixel{uchar(round(img_.GetLinearRVal(x, y))),
-                                  uchar(round(img_.GetLinearGVal(x, y))),
-                                  uchar(round(img_.GetLinearBVal(x, y)))};
+      CColorPixel p = CColorPixel{uchar(round(lin_r[x])),
+                                  uchar(round(lin_g[x])),
+                                  uchar(round(lin_b[x]))};
       CColorPixel pixel = ModifyPixelByMap(p, x, y, bayer, n);
-      img_.PutPixelWithGamma(x, y, pixel.r, pixel.g, pixel.b);
+      lin_r[x] = pixel.r;
+      lin_g[x] = pixel.g;
+      lin_b[x] = pixel.b;
     }
+    img_.EncodeRow(y, rows_);
   }
 }
 
 template<>
 void CDitherer<CMonoPixel>::DoRandomDithering(int n, int seed) {
   rand.seed(seed);
+  float *lin = rows_[0];
   for (int y = 0; y < img_.GetHeight(); y++) {
+    img_.LinearizeRow(y, rows_);
     for (int x = 0; x < img_.GetWidth(); x++) {
-      CMonoPixel p = CMonoPixel{uchar(round(img_.GetLinearVal(x, y)))};
-      img_.PutPixelWithGamma(x, y, ModifyPixelByRandom(p, n, seed).val);
+      CMonoPixel p = CMonoPixel{uchar(round(lin[x]))};
+      lin[x] = ModifyPixelByRandom(p, n, seed).val;
     }
+    img_.EncodeRow(y, rows_);
   }
 }
 
 template<>
 void CDitherer<CColorPixel>::DoRandomDithering(int n, int seed) {
   rand.seed(seed);
+  float *lin_r = rows_[0];
+  float *lin_g = rows_[1];
+  float *lin_b = rows_[2];
   for (int y = 0; y < img_.GetHeight(); y++) {
+    img_.LinearizeRow(y, rows_);
     for (int x = 0; x < img_.GetWidth(); x++) {
-      CColorPixel p = CColorPixel{uchar(round(img_.GetLinearRVal(x, y))),
-                                  uchar(round(img_.GetLinearGVal(x, y))),
-                                  uchar(round(img_.GetLinearBVal(x, y)))};
+      CColorPixel p = CColorPixel{uchar(round(lin_r[x])),
+                                  uchar(round(lin_g[x])),
+                                  uchar(round(lin_b[x]))};
       CColorPixel pixel = ModifyPixelByRandom(p, n, seed);
-      img_.PutPixelWithGamma(x, y, pixel.r, pixel.g, pixel.b);
+      lin_r[x] = pixel.r;
+      lin_g[x] = pixel.g;
+      lin_b[x] = pixel.b;
     }
+    img_.EncodeRow(y, rows_);
   }
 }
 
 template<>
 void CDitherer<CMonoPixel>::DoFloydSteinbergDithering(int n) {
+  float *lin = rows_[0];
   for (int y = 0; y < img_.GetHeight(); y++) {
+    img_.LinearizeRow(y, rows_);
     for (int x = 0; x < img_.GetWidth(); x++) {
-      double old_pixel = img_.GetLinearVal(x, y);
+      double old_pixel = lin[x];
       double new_pixel = FindNearestPaletteColor((old_pixel + gray_buffer.Get(x, y)), n);
       double quant_err = old_pixel + gray_buffer.Get(x, y) - new_pixel;
 
-      img_.PutPixelWithGamma(x, y, new_pixel);
+      lin[x] = new_pixel;
 
       if (x + 1 < img_.GetWidth()) {
         gray_buffer.Add(x + 1, y, quant_err * (7.0 / 16.0));
@@ -423,21 +477,29 @@ void CDitherer<CMonoPixel>::DoFloydSteinbergDithering(int n) {
         gray_buffer.Add(x + 1, y + 1, quant_err * (1.0 / 16.0));
       }
     }
+    img_.EncodeRow(y, rows_);
+    gray_buffer.NextRow(y);
   }
 }
 
 template<>
 void CDitherer<CColorPixel>::DoFloydSteinbergDithering(int n) {
+  float *lin_r = rows_[0];
+  float *lin_g = rows_[1];
+  float *lin_b = rows_[2];
   for (int y = 0; y < img_.GetHeight(); y++) {
+    img_.LinearizeRow(y, rows_);
     for (int x = 0; x < img_.GetWidth(); x++) {
-      double old_pixel_r = img_.GetLinearRVal(x, y);
-      double old_pixel_g = img_.GetLinearGVal(x, y);
-      double old_pixel_b = img_.GetLinearBVal(x, y);
+      double old_pixel_r = lin_r[x];
+      double old_pixel_g = lin_g[x];
+      double old_pixel_b = lin_b[x];
       double new_pixel_r = FindNearestPaletteColor(round(double(old_pixel_r) + color_buffer.GetR(x, y)), n);
       double new_pixel_g = FindNearestPaletteColor(round(double(old_pixel_g) + color_buffer.GetG(x, y)), n);
       double new_pixel_b = FindNearestPaletteColor(round(double(old_pixel_b) + color_buffer.GetB(x, y)), n);
 
-      img_.PutPixelWithGamma(x, y, new_pixel_r, new_pixel_g, new_pixel_b);
+      lin_r[x] = new_pixel_r;
+      lin_g[x] = new_pixel_g;
+      lin_b[x] = new_pixel_b;
       double quant_err_r = old_pixel_r + color_buffer.GetR(x, y) - new_pixel_r;
       double quant_err_g = old_pixel_g + color_buffer.GetG(x, y) - new_pixel_g;
       double quant_err_b = old_pixel_b + color_buffer.GetB(x, y) - new_pixel_b;
@@ -470,20 +532,28 @@ void CDitherer<CColorPixel>::DoFloydSteinbergDithering(int n) {
                          double((quant_err_r * 1.0) / 16));
       }
     }
+    img_.EncodeRow(y, rows_);
+    color_buffer.NextRow(y);
   }
 }
 
 template<>
 void CDitherer<CColorPixel>::DoJJNDithering(int n) {
+  float *lin_r = rows_[0];
+  float *lin_g = rows_[1];
+  float *lin_b = rows_[2];
   for (int y = 0; y < img_.GetHeight(); y++) {
+    img_.LinearizeRow(y, rows_);
     for (int x = 0; x < img_.GetWidth(); x++) {
-      double old_pixel_r = img_.GetLinearRVal(x, y);
-      double old_pixel_g = img_.GetLinearGVal(x, y);
-      double old_pixel_b = img_.GetLinearBVal(x, y);
+      double old_pixel_r = lin_r[x];
+      double old_pixel_g = lin_g[x];
+      double old_pixel_b = lin_b[x];
       double new_pixel_r = FindNearestPaletteColor(old_pixel_r + color_buffer.GetR(x, y), n);
       double new_pixel_g = FindNearestPaletteColor(old_pixel_g + color_buffer.GetG(x, y), n);
       double new_pixel_b = FindNearestPaletteColor(old_pixel_b + color_buffer.GetB(x, y), n);
-      img_.PutPixelWithGamma(x, y, new_pixel_r, new_pixel_g, new_pixel_b);
+      lin_r[x] = new_pixel_r;
+      lin_g[x] = new_pixel_g;
+      lin_b[x] = new_pixel_b;
       double quant_err_r = old_pixel_r + color_buffer.GetR(x, y) - new_pixel_r;
       double quant_err_g = old_pixel_g + color_buffer.GetG(x, y) - new_pixel_g;
       double quant_err_b = old_pixel_b + color_buffer.GetB(x, y) - new_pixel_b;
@@ -573,17 +643,21 @@ void CDitherer<CColorPixel>::DoJJNDithering(int n) {
         color_buffer.Add(x + 2, y + 2, double(quant_err_r / del), double(quant_err_g / del), double(quant_err_b / del));
       }
     }
+    img_.EncodeRow(y, rows_);
+    color_buffer.NextRow(y);
   }
 }
 
 template<>
 void CDitherer<CMonoPixel>::DoJJNDithering(int n) {
+  float *lin = rows_[0];
   for (int y = 0; y < img_.GetHeight(); y++) {
+    img_.LinearizeRow(y, rows_);
     for (int x = 0; x < img_.GetWidth(); x++) {
-      double old_pixel = img_.GetLinearVal(x, y);
+      double old_pixel = lin[x];
       double new_pixel = FindNearestPaletteColor(old_pixel + gray_buffer.Get(x, y), n);
 
-      img_.PutPixelWithGamma(x, y, new_pixel);
+      lin[x] = new_pixel;
       double quant_err = old_pixel + gray_buffer.Get(x, y) - new_pixel;
 
       if (x + 1 < img_.GetWidth()) {
@@ -634,17 +708,21 @@ void CDitherer<CMonoPixel>::DoJJNDithering(int n) {
         gray_buffer.Add(x + 2, y + 2, (quant_err) / 48.0);
       }
     }
+    img_.EncodeRow(y, rows_);
+    gray_buffer.NextRow(y);
   }
 }
 
 template<>
 void CDitherer<CMonoPixel>::DoAtkinsonDithering(int n) {
+  float *lin = rows_[0];
   for (int y = 0; y < img_.GetHeight(); y++) {
+    img_.LinearizeRow(y, rows_);
     for (int x = 0; x < img_.GetWidth(); x++) {
-      double old_pixel = img_.GetLinearVal(x, y);
+      double old_pixel = lin[x];
       double new_pixel = FindNearestPaletteColor(old_pixel + gray_buffer.Get(x, y), n);
       double quant_err = old_pixel + gray_buffer.Get(x, y) - new_pixel;
-      img_.PutPixelWithGamma(x, y, new_pixel);
+      lin[x] = new_pixel;
 
       if (x + 1 < img_.GetWidth()) {
         gray_buffer.Add(x + 1, y, (quant_err) / 8.0);
@@ -670,16 +748,22 @@ void CDitherer<CMonoPixel>::DoAtkinsonDithering(int n) {
         gray_buffer.Add(x, y + 2, (quant_err) / 8.0);
       }
     }
+    img_.EncodeRow(y, rows_);
+    gray_buffer.NextRow(y);
   }
 }
 
 template<>
 void CDitherer<CColorPixel>::DoAtkinsonDithering(int n) {
+  float *lin_r = rows_[0];
+  float *lin_g = rows_[1];
+  float *lin_b = rows_[2];
   for (int y = 0; y < img_.GetHeight(); y++) {
+    img_.LinearizeRow(y, rows_);
     for (int x = 0; x < img_.GetWidth(); x++) {
-      double old_pixel_r = img_.GetLinearRVal(x, y);
-      double old_pixel_g = img_.GetLinearGVal(x, y);
-      double old_pixel_b = img_.GetLinearBVal(x, y);
+      double old_pixel_r = lin_r[x];
+      double old_pixel_g = lin_g[x];
+      double old_pixel_b = lin_b[x];
 
       double new_pixel_r = FindNearestPaletteColor(old_pixel_r + color_buffer.GetR(x, y), n);
       double new_pixel_g = FindNearestPaletteColor(old_pixel_g + color_buffer.GetG(x, y), n);
@@ -689,7 +773,9 @@ void CDitherer<CColorPixel>::DoAtkinsonDithering(int n) {
       double quant_err_g = old_pixel_g + color_buffer.GetG(x, y) - new_pixel_g;
       double quant_err_b = old_pixel_b + color_buffer.GetB(x, y) - new_pixel_b;
 
-      img_.PutPixelWithGamma(x, y, new_pixel_r, new_pixel_g, new_pixel_b);
+      lin_r[x] = new_pixel_r;
+      lin_g[x] = new_pixel_g;
+      lin_b[x] = new_pixel_b;
       if (x + 1 < img_.GetWidth()) {
         color_buffer.Add(x + 1,
                          y,
@@ -734,16 +820,20 @@ void CDitherer<CColorPixel>::DoAtkinsonDithering(int n) {
         color_buffer.Add(x, y + 2, (quant_err_r) / 8.0, (quant_err_g) / 8.0, (quant_err_b) / 8.0);
       }
     }
+    img_.EncodeRow(y, rows_);
+    color_buffer.NextRow(y);
   }
 }
 
 template<>
 void CDitherer<CMonoPixel>::DoSierraDithering(int n) {
+  float *lin = rows_[0];
   for (int y = 0; y < img_.GetHeight(); y++) {
+    img_.LinearizeRow(y, rows_);
     for (int x = 0; x < img_.GetWidth(); x++) {
-      double old_pixel = img_.GetLinearVal(x, y);
+      double old_pixel = lin[x];
       double new_pixel = FindNearestPaletteColor(old_pixel + gray_buffer.Get(x, y), n);
-      img_.PutPixelWithGamma(x, y, new_pixel);
+      lin[x] = new_pixel;
       double quant_err = old_pixel + gray_buffer.Get(x, y) - new_pixel;
       if (x + 1 < img_.GetWidth()) {
         gray_buffer.Add(x + 1, y, (quant_err * 5.0) / 32);
@@ -785,22 +875,30 @@ void CDitherer<CMonoPixel>::DoSierraDithering(int n) {
         gray_buffer.Add(x + 1, y + 2, (quant_err * 2.0) / 32);
       }
     }
+    img_.EncodeRow(y, rows_);
+    gray_buffer.NextRow(y);
   }
 }
 
 template<>
 void CDitherer<CColorPixel>::DoSierraDithering(int n) {
+  float *lin_r = rows_[0];
+  float *lin_g = rows_[1];
+  float *lin_b = rows_[2];
   for (int y = 0; y < img_.GetHeight(); y++) {
+    img_.LinearizeRow(y, rows_);
     for (int x = 0; x < img_.GetWidth(); x++) {
-      double old_pixel_r = img_.GetLinearRVal(x, y);
-      double old_pixel_g = img_.GetLinearGVal(x, y);
-      double old_pixel_b = img_.GetLinearBVal(x, y);
+      double old_pixel_r = lin_r[x];
+      double old_pixel_g = lin_g[x];
+      double old_pixel_b = lin_b[x];
 
       double new_pixel_r = FindNearestPaletteColor(old_pixel_r + color_buffer.GetR(x, y), n);
       double new_pixel_g = FindNearestPaletteColor(old_pixel_g + color_buffer.GetG(x, y), n);
       double new_pixel_b = FindNearestPaletteColor(old_pixel_b + color_buffer.GetB(x, y), n);
 
-      img_.PutPixelWithGamma(x, y, new_pixel_r, new_pixel_g, new_pixel_b);
+      lin_r[x] = new_pixel_r;
+      lin_g[x] = new_pixel_g;
+      lin_b[x] = new_pixel_b;
       double quant_err_r = old_pixel_r + color_buffer.GetR(x, y) - new_pixel_r;
       double quant_err_g = old_pixel_g + color_buffer.GetG(x, y) - new_pixel_g;
       double quant_err_b = old_pixel_b + color_buffer.GetB(x, y) - new_pixel_b;
@@ -885,72 +983,102 @@ void CDitherer<CColorPixel>::DoSierraDithering(int n) {
                          (quant_err_b * 2.0) / 32);
       }
     }
+    img_.EncodeRow(y, rows_);
+    color_buffer.NextRow(y);
   }
 }
 
 template<>
 void CDitherer<CMonoPixel>::DoHalftoneDithering(int n) {
+  float *lin = rows_[0];
   for (int y = 0; y < img_.GetHeight(); y++) {
+    img_.LinearizeRow(y, rows_);
     for (int x = 0; x < img_.GetWidth(); x++) {
-      CMonoPixel p = img_.Clamp(img_.GetLinearVal(x, y));
+      CMonoPixel p = img_.Clamp(lin[x]);
       CMonoPixel pixel = ModifyPixelByMap(p, x, y, HALFTONE_ORTHOGONAL, n);
-      img_.PutPixelWithGamma(x, y, pixel.val);
+      lin[x] = pixel.val;
     }
+    img_.EncodeRow(y, rows_);
   }
 }
 
 template<>
 void CDitherer<CColorPixel>::DoHalftoneDithering(int n) {
+  float *lin_r = rows_[0];
+  float *lin_g = rows_[1];
+  float *lin_b = rows_[2];
   for (int y = 0; y < img_.GetHeight(); y++) {
+    img_.LinearizeRow(y, rows_);
     for (int x = 0; x < img_.GetWidth(); x++) {
-      CColorPixel p = CColorPixel{uchar(round(img_.GetLinearRVal(x, y))),
-                                  uchar(round(img_.GetLinearGVal(x, y))),
-                                  uchar(round(img_.GetLinearBVal(x, y)))};
+      CColorPixel p = CColorPixel{uchar(round(lin_r[x])),
+                                  uchar(round(lin_g[x])),
+                                  uchar(round(lin_b[x]))};
       CColorPixel pixel = ModifyPixelByMap(p, x, y, HALFTONE_ORTHOGONAL, n);
-      img_.PutPixelWithGamma(x, y, pixel.r, pixel.g, pixel.b);
+      lin_r[x] = pixel.r;
+      lin_g[x] = pixel.g;
+      lin_b[x] = pixel.b;
     }
+    img_.EncodeRow(y, rows_);
   }
 }
 
 template<>
 void CDitherer<CMonoPixel>::DoErrorDiffDithering(const ErrorDiffMatrix &matrix, int n) {
+  if (matrix.h_ - 1 - matrix.y0_ > GrayCompensationBuffer::ROWS - 1) {
+    throw CImageParamsException();
+  }
+  float *lin = rows_[0];
   for (int y = 0; y < img_.GetHeight(); y++) {
+    img_.LinearizeRow(y, rows_);
     for (int x = 0; x < img_.GetWidth(); x++) {
-      double old_pixel = img_.GetLinearVal(x, y);
+      double old_pixel = lin[x];
       double new_pixel = FindNearestPaletteColor(double(old_pixel) + gray_buffer.Get(x, y), n);
-      img_.PutPixelWithGamma(x, y, new_pixel);
+      lin[x] = new_pixel;
       double quant_err = old_pixel - new_pixel;
       ApplyErrorDiffMatrix(matrix, x, y, quant_err);
     }
+    img_.EncodeRow(y, rows_);
+    gray_buffer.NextRow(y);
   }
 }
 
 template<>
 void CDitherer<CColorPixel>::DoErrorDiffDithering(const ErrorDiffMatrix &matrix, int n) {
+  if (matrix.h_ - 1 - matrix.y0_ > ColorCompensationBuffer::ROWS - 1) {
+    throw CImageParamsException();
+  }
+  float *lin_r = rows_[0];
+  float *lin_g = rows_[1];
+  float *lin_b = rows_[2];
   for (int y = 0; y < img_.GetHeight(); y++) {
+    img_.LinearizeRow(y, rows_);
     for (int x = 0; x < img_.GetWidth(); x++) {
-      double old_pixel_r = img_.GetLinearRVal(x, y);
-      double old_pixel_g = img_.GetLinearGVal(x, y);
-      double old_pixel_b = img_.GetLinearBVal(x, y);
+      double old_pixel_r = lin_r[x];
+      double old_pixel_g = lin_g[x];
+      double old_pixel_b = lin_b[x];
 
       double new_pixel_r = FindNearestPaletteColor(double(old_pixel_r) + color_buffer.GetR(x, y), n);
       double new_pixel_g = FindNearestPaletteColor(double(old_pixel_g) + color_buffer.GetG(x, y), n);
       double new_pixel_b = FindNearestPaletteColor(double(old_pixel_b) + color_buffer.GetB(x, y), n);
 
-      img_.PutPixelWithGamma(x, y, new_pixel_r, new_pixel_g, new_pixel_b);
+      lin_r[x] = new_pixel_r;
+      lin_g[x] = new_pixel_g;
+      lin_b[x] = new_pixel_b;
       double quant_err_r = old_pixel_r - new_pixel_r;
       double quant_err_g = old_pixel_g - new_pixel_g;
       double quant_err_b = old_pixel_b - new_pixel_b;
 
       ApplyErrorDiffMatrix(matrix, x, y, quant_err_r, quant_err_g, quant_err_b);
     }
+    img_.EncodeRow(y, rows_);
+    color_buffer.NextRow(y);
   }
 }
 
 template<class T>
 double CDitherer<T>::FindNearestPaletteColor(double color_val, int n) {
   color_val = std::max(std::min(255.0, color_val), 0.0);
-  int levels = pow(2, n);
+  int levels = 1 << n;
   double interval_len = double(img_.GetMaxVal()) / (levels - 1);
   double thresh_ind = round((color_val) / interval_len);
   double out = thresh_ind * interval_len;
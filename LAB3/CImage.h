@@ -12,8 +12,10 @@ typedef unsigned char uchar;
 #include <cmath>
 #include <map>
 #include <set>
+#include <thread>
 
 #include "CImage.h"
+#include "CTransfer.h"
 #include "CImageFileOpenException.h"
 #include "CImageFileDeleteException.h"
 #include "CImageParamsException.h"
@@ -69,7 +71,27 @@ class CImage {
 
   void PutPixelWithGamma(int x, int y, double val_r, double val_g, double val_b);
 
-  void CorrectImageWithGamma();
+  // Applies the encode curve to the stored values in place, rounded. Rows
+  // are split among threads, 0 takes the hardware concurrency
+  void CorrectImageWithGamma(int threads = 0);
+
+  // Maps every stored value through a 256 entry table in place: tables[c]
+  // for channel c, or tables[0] for all of them. Rows are split among
+  // threads, 0 takes the hardware concurrency
+  void MapValues(const std::vector<std::vector<uchar>> &tables, int threads = 0);
+
+  // Bulk transfer for whole rows: rows[c][x] is channel c (one for P5, r, g,
+  // b for P6) of pixel x in linear light
+  void LinearizeRow(int y, float *const *rows) const;
+
+  void EncodeRow(int y, const float *const *rows);
+
+  int GetChannels() const;
+
+  // 0 selects sRGB; rebuilds the transfer tables
+  void SetGamma(double gamma);
+
+  double GetGamma() const;
 
   T *operator[](int i);
 
@@ -96,6 +118,10 @@ class CImage {
   int max_val_;
   T *data_;
   double gamma_;
+  // Rebuilt with the gamma
+  CTransfer transfer_;
+
+  void BuildGammaTables();
 
   bool FileExists(const char *s);
 
@@ -132,6 +158,7 @@ CImage<T>::CImage(const std::string &fname, double gamma)
     throw CImageMemAllocException();
   }
   fclose(f);
+  BuildGammaTables();
 }
 
 template<typename T>
@@ -148,6 +175,7 @@ CImage<T>::CImage(const std::string &fname, FileType type, int w, int h,
   } catch (std::bad_alloc &e) {
     throw CImageMemAllocException();
   }
+  BuildGammaTables();
 }
 
 template<typename T>
@@ -164,6 +192,7 @@ CImage<T>::CImage(const std::string &fname, FileType type, int w, int h,
       this[i][j] = data[i * w_ + j];
     }
   }
+  BuildGammaTables();
 }
 
 template<class T>
@@ -177,6 +206,7 @@ CImage<T>::CImage(int w, int h, int max_val, FileType type, double gamma)
   } catch (std::bad_alloc &e) {
     throw CImageMemAllocException();
   }
+  BuildGammaTables();
 }
 
 template<typename T>
@@ -189,54 +219,22 @@ T CImage<T>::GetPixel(int x, int y) const {
 
 template<>
 double CImage<CMonoPixel>::GetLinearVal(int x, int y) const {
-  if (gamma_ == 0) {
-    double c = GetPixel(x, y).val / double(max_val_);
-    if (c <= 0.04045) {
-      return c * max_val_ / 12.92;
-    } else {
-      return pow((c + 0.055) / 1.055, 2.4) * double(max_val_);
-    }
-  }
-  return pow(double(GetPixel(x, y).val) / double(max_val_), gamma_) * double(max_val_);
+  return transfer_.Decode(GetPixel(x, y).val);
 }
 
 template<>
 double CImage<CColorPixel>::GetLinearRVal(int x, int y) const {
-  if (gamma_ == 0) {
-    double c = GetPixel(x, y).r / double(max_val_);
-    if (c <= 0.04045) {
-      return c * max_val_ / 12.92;
-    } else {
-      return pow((c + 0.055) / 1.055, 2.4) * max_val_;
-    }
-  }
-  return pow(double(GetPixel(x, y).r) / double(max_val_), gamma_) * max_val_;
+  return transfer_.Decode(GetPixel(x, y).r);
 }
 
 template<>
 double CImage<CColorPixel>::GetLinearGVal(int x, int y) const {
-  if (gamma_ == 0) {
-    double c = GetPixel(x, y).g / double(max_val_);
-    if (c <= 0.04045) {
-      return c * max_val_ / 12.92;
-    } else {
-      return pow((c + 0.055) / 1.055, 2.4) * max_val_;
-    }
-  }
-  return pow(double(GetPixel(x, y).g) / double(max_val_), gamma_) * max_val_;
+  return transfer_.Decode(GetPixel(x, y).g);
 }
 
 template<>
 double CImage<CColorPixel>::GetLinearBVal(int x, int y) const {
-  if (gamma_ == 0) {
-    double c = GetPixel(x, y).b / double(max_val_);
-    if (c <= 0.04045) {
-      return c * max_val_ / 12.92;
-    } else {
-      return pow((c + 0.055) / 1.055, 2.4) * max_val_;
-    }
-  }
-  return pow(double(GetPixel(x, y).b) / double(max_val_), gamma_) * max_val_;
+  return transfer_.Decode(GetPixel(x, y).b);
 }
 
 template<class T>
@@ -249,70 +247,103 @@ void CImage<T>::PutPixel(int x, int y, T pixel) {
 template<>
 void CImage<CMonoPixel>::PutPixelWithGamma(int x, int y, double val) {
   if (x >= 0 && y >= 0 && x < w_ && y < h_) {
-    if (gamma_ == 0) {
-      double c = val / double(max_val_);
-      if (c <= 0.0031308) {
-        data_[y * w_ + x] = Clamp(12.92 * c * max_val_);
-      } else {
-        data_[y * w_ + x] = Clamp((1.055 * pow(c, 1.0 / 2.4) - 0.055) * max_val_);
-      }
-    } else {
-      data_[y * w_ + x] = Clamp(round(pow(val / max_val_, 1.0 / gamma_) * double(max_val_)));
-    }
+    data_[y * w_ + x] = {uchar(transfer_.Encode(val))};
   }
 }
 
 template<>
 void CImage<CColorPixel>::PutPixelWithGamma(int x, int y, double val_r, double val_g, double val_b) {
   if (x >= 0 && y >= 0 && x < w_ && y < h_) {
-    if (gamma_ == 0) {
-      double c_r = val_r / double(max_val_);
-      double c_g = val_g / double(max_val_);
-      double c_b = val_b / double(max_val_);
-      uchar r = 0;
-      uchar g = 0;
-      uchar b = 0;
-      if (c_r <= 0.0031308) {
-        r = uchar(12.92 * c_r * max_val_);
-      } else {
-        r = uchar((1.055 * pow(c_r, 1.0 / 2.4) - 0.055) * max_val_);
-      }
-      if (c_g <= 0.0031308) {
-        g = uchar(12.92 * c_g * max_val_);
-      } else {
-        g = uchar((1.055 * pow(c_g, 1.0 / 2.4) - 0.055) * max_val_);
-      }
-      if (c_b <= 0.0031308) {
-        b = uchar(12.92 * c_b * max_val_);
-      } else {
-        b = uchar((1.055 * pow(c_b, 1.0 / 2.4) - 0.055) * max_val_);
-      }
-      data_[y * w_ + x] = {r, g, b};
-    } else {
-      data_[y * w_ + x] = {uchar(round(pow(val_r / max_val_, 1.0 / gamma_) * double(max_val_))),
-                           uchar(round(pow(val_g / max_val_, 1.0 / gamma_) * double(max_val_))),
-                           uchar(round(pow(val_b / max_val_, 1.0 / gamma_) * double(max_val_)))};
-    }
+    data_[y * w_ + x] = {uchar(transfer_.Encode(val_r)), uchar(transfer_.Encode(val_g)), uchar(transfer_.Encode(val_b))};
   }
 }
 
-template<>
-void CImage<CMonoPixel>::CorrectImageWithGamma() {
-  for (int y = 0; y < GetHeight(); y++) {
-    for (int x = 0; x < GetWidth(); x++) {
-      PutPixel(x, y, {uchar(std::pow((double) GetPixel(x, y).val / (double) max_val_, 1.0 / gamma_) * max_val_)});
-    }
+template<class T>
+int CImage<T>::GetChannels() const {
+  return sizeof(T);
+}
+
+template<class T>
+void CImage<T>::LinearizeRow(int y, float *const *rows) const {
+  const int channels = sizeof(T);
+  const uchar *src = (const uchar *) (data_ + y * w_);
+  for (int c = 0; c < channels; c++) {
+    transfer_.DecodeRow(src + c, channels, rows[c], w_);
   }
 }
 
-template<>
-void CImage<CColorPixel>::CorrectImageWithGamma() {
-  for (int y = 0; y < GetHeight(); y++) {
-    for (int x = 0; x < GetWidth(); x++) {
-      PutPixel(x, y, {uchar(std::pow((double) GetPixel(x, y).r / (double) max_val_, 1.0 / gamma_) * max_val_),
-                      uchar(std::pow((double) GetPixel(x, y).g / (double) max_val_, 1.0 / gamma_) * max_val_),
-                      uchar(std::pow((double) GetPixel(x, y).b / (double) max_val_, 1.0 / gamma_) * max_val_)});
+template<class T>
+void CImage<T>::EncodeRow(int y, const float *const *rows) {
+  const int channels = sizeof(T);
+  uchar *dst = (uchar *) (data_ + y * w_);
+  for (int c = 0; c < channels; c++) {
+    transfer_.EncodeRow(rows[c], dst + c, channels, w_);
+  }
+}
+
+template<class T>
+void CImage<T>::SetGamma(double gamma) {
+  gamma_ = gamma;
+  BuildGammaTables();
+}
+
+template<class T>
+double CImage<T>::GetGamma() const {
+  return gamma_;
+}
+
+template<class T>
+void CImage<T>::BuildGammaTables() {
+  transfer_ = CTransfer::FromGamma(gamma_, max_val_);
+}
+
+template<class T>
+void CImage<T>::CorrectImageWithGamma(int threads) {
+  MapValues({transfer_.GetCorrectionTable()}, threads);
+}
+
+// One table for every channel goes through the vectorized lookup; per
+// channel tables take a plain loop over the pixels
+template<class T>
+void CImage<T>::MapValues(const std::vector<std::vector<uchar>> &tables, int threads) {
+  const int channels = sizeof(T);
+  if (tables.size() != 1 && tables.size() != (size_t) channels) {
+    throw CImageParamsException();
+  }
+  for (const std::vector<uchar> &table : tables) {
+    if (table.size() != 256) {
+      throw CImageParamsException();
+    }
+  }
+  // More bands than cores only take turns, and bands below a few hundred KiB
+  // are not worth a thread
+  int cores = std::max(1, (int) std::thread::hardware_concurrency());
+  threads = threads <= 0 ? cores : std::min(threads, cores);
+  size_t row_size = (size_t) w_ * channels;
+  threads = std::min(threads, h_);
+  threads = (int) std::min<size_t>(threads, std::max<size_t>(1, row_size * h_ / (256 << 10)));
+  auto band = [&](int i) {
+    int y_begin = (int) ((long long) h_ * i / threads);
+    int y_end = (int) ((long long) h_ * (i + 1) / threads);
+    uchar *data = (uchar *) (data_ + (size_t) y_begin * w_);
+    size_t size = row_size * (y_end - y_begin);
+    if (tables.size() == 1) {
+      CTransfer::ApplyTable(tables[0].data(), data, size);
+      return;
     }
+    for (size_t j = 0; j < size; j += channels) {
+      for (int c = 0; c < channels; c++) {
+        data[j + c] = tables[c][data[j + c]];
+      }
+    }
+  };
+  std::vector<std::thread> workers;
+  for (int i = 1; i < threads; i++) {
+    workers.emplace_back(band, i);
+  }
+  band(0);
+  for (std::thread &worker : workers) {
+    worker.join();
   }
 }
 
@@ -394,7 +425,8 @@ T apply_alpha(T bright, T under_color, int a, double gamma) {
 
 template<class T>
 CImage<T>::CImage(const CImage<T> &img)
-    : w_(img.GetWidth()), h_(img.GetHeight()), max_val_(img.GetMaxVal()), type_(img.GetFileType()) {
+    : fname_(img.fname_), type_(img.GetFileType()), w_(img.GetWidth()), h_(img.GetHeight()),
+      max_val_(img.GetMaxVal()), gamma_(img.gamma_), transfer_(img.transfer_) {
   data_ = new T[w_ * h_];
   for (int i = 0; i < w_ * h_; i++) {
     data_[i] = img.data_[i];
@@ -0,0 +1,359 @@
+#ifndef COMPUTERGEOMETRY_GRAPHICS_CTONECURVE_H
+#define COMPUTERGEOMETRY_GRAPHICS_CTONECURVE_H
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+#include "CImage.h"
+#include "CImageParamsException.h"
+
+// Chain of point operations on stored values, composed into one 256 entry
+// table per channel: every entry runs through the whole chain in double and
+// is rounded once, and the image is mapped in a single pass.
+//
+// Values are in stored levels (0..max_val of the image). A step can be
+// limited to some channels of P6 images; applying such a step to a P5 image
+// throws CImageParamsException.
+//
+// Parse reads chains like "invert,gamma=2.2,levels=16:235": steps separated
+// by commas, each a name with an optional .channels suffix (letters from
+// rgb) and =arguments separated by colons:
+//   invert
+//   gamma=g                  c^(1 / g), as CorrectImageWithGamma
+//   levels=lo:hi[:g[:out_lo:out_hi]]
+//   curves=x:y/x:y/...       monotone cubic through the points
+//   threshold=t              max_val from t up, 0 below
+//   contrast=k               k times the distance from mid gray
+class CToneCurve {
+ public:
+  static const int ALL_CHANNELS = 7;
+
+  // Bit c of channels selects channel c (r, g, b)
+  CToneCurve &Invert(int channels = ALL_CHANNELS);
+
+  CToneCurve &Gamma(double gamma, int channels = ALL_CHANNELS);
+
+  // out_white < 0 stands for max_val
+  CToneCurve &Levels(double in_black, double in_white, double gamma = 1, double out_black = 0,
+                     double out_white = -1, int channels = ALL_CHANNELS);
+
+  CToneCurve &Curves(const std::vector<std::pair<double, double>> &points,
+                     int channels = ALL_CHANNELS);
+
+  CToneCurve &Threshold(double level, int channels = ALL_CHANNELS);
+
+  CToneCurve &Contrast(double amount, int channels = ALL_CHANNELS);
+
+  static CToneCurve Parse(const std::string &chain);
+
+  // Channel -1 is the single channel of P5 images
+  double Evaluate(int channel, double val, int max_val) const;
+
+  std::vector<uchar> BuildTable(int channel, int max_val) const;
+
+  template<class T>
+  void Apply(CImage<T> &img, int threads = 0) const;
+
+ private:
+  enum Operation {
+    INVERT,
+    GAMMA,
+    LEVELS,
+    CURVES,
+    THRESHOLD,
+    CONTRAST
+  };
+
+  struct Step {
+    Operation op;
+    int channels;
+    std::vector<double> args;
+    // Curves: control points and the tangents at them
+    std::vector<double> xs, ys, slopes;
+  };
+
+  std::vector<Step> steps_;
+
+  CToneCurve &Add(Operation op, std::vector<double> args, int channels);
+
+  bool AppliesTo(const Step &step, int channel) const;
+
+  static double EvaluateStep(const Step &step, double val, double m);
+
+  static double EvaluateCurves(const Step &step, double val);
+
+  static int ParseChannels(const std::string &letters);
+
+  static std::vector<double> ParseNumbers(const std::string &text, char separator);
+};
+
+inline CToneCurve &CToneCurve::Invert(int channels) {
+  return Add(INVERT, {}, channels);
+}
+
+inline CToneCurve &CToneCurve::Gamma(double gamma, int channels) {
+  if (!(gamma > 0)) {
+    throw CImageParamsException();
+  }
+  return Add(GAMMA, {gamma}, channels);
+}
+
+inline CToneCurve &CToneCurve::Levels(double in_black, double in_white, double gamma,
+                                      double out_black, double out_white, int channels) {
+  if (!(in_white > in_black) || !(gamma > 0)) {
+    throw CImageParamsException();
+  }
+  return Add(LEVELS, {in_black, in_white, gamma, out_black, out_white}, channels);
+}
+
+// Fritsch-Carlson tangents: averaged secants, flattened at extrema and
+// scaled down where they would overshoot
+inline CToneCurve &CToneCurve::Curves(const std::vector<std::pair<double, double>> &points,
+                                      int channels) {
+  int n = points.size();
+  if (n < 2) {
+    throw CImageParamsException();
+  }
+  Add(CURVES, {}, channels);
+  Step &step = steps_.back();
+  std::vector<double> secants(n - 1);
+  for (int i = 0; i < n; i++) {
+    step.xs.push_back(points[i].first);
+    step.ys.push_back(points[i].second);
+    if (i > 0) {
+      double dx = points[i].first - points[i - 1].first;
+      if (!(dx > 0)) {
+        steps_.pop_back();
+        throw CImageParamsException();
+      }
+      secants[i - 1] = (points[i].second - points[i - 1].second) / dx;
+    }
+  }
+  step.slopes.resize(n);
+  step.slopes[0] = secants[0];
+  step.slopes[n - 1] = secants[n - 2];
+  for (int i = 1; i < n - 1; i++) {
+    step.slopes[i] = secants[i - 1] * secants[i] > 0 ? (secants[i - 1] + secants[i]) / 2 : 0;
+  }
+  for (int i = 0; i < n - 1; i++) {
+    if (secants[i] == 0) {
+      step.slopes[i] = step.slopes[i + 1] = 0;
+      continue;
+    }
+    double a = step.slopes[i] / secants[i];
+    double b = step.slopes[i + 1] / secants[i];
+    if (a * a + b * b > 9) {
+      double tau = 3 / sqrt(a * a + b * b);
+      step.slopes[i] = tau * a * secants[i];
+      step.slopes[i + 1] = tau * b * secants[i];
+    }
+  }
+  return *this;
+}
+
+inline CToneCurve &CToneCurve::Threshold(double level, int channels) {
+  return Add(THRESHOLD, {level}, channels);
+}
+
+inline CToneCurve &CToneCurve::Contrast(double amount, int channels) {
+  return Add(CONTRAST, {amount}, channels);
+}
+
+inline CToneCurve &CToneCurve::Add(Operation op, std::vector<double> args, int channels) {
+  if (channels <= 0 || channels > ALL_CHANNELS) {
+    throw CImageParamsException();
+  }
+  steps_.push_back({op, channels, std::move(args), {}, {}, {}});
+  return *this;
+}
+
+inline CToneCurve CToneCurve::Parse(const std::string &chain) {
+  CToneCurve curve;
+  size_t begin = 0;
+  while (begin <= chain.size()) {
+    size_t end = std::min(chain.find(',', begin), chain.size());
+    std::string step = chain.substr(begin, end - begin);
+    begin = end + 1;
+
+    size_t eq = step.find('=');
+    std::string name = step.substr(0, eq);
+    std::string args = eq == std::string::npos ? "" : step.substr(eq + 1);
+    int channels = ALL_CHANNELS;
+    size_t dot = name.find('.');
+    if (dot != std::string::npos) {
+      channels = ParseChannels(name.substr(dot + 1));
+      name = name.substr(0, dot);
+    }
+
+    if (name == "invert" && args.empty()) {
+      curve.Invert(channels);
+    } else if (name == "gamma" || name == "threshold" || name == "contrast") {
+      std::vector<double> values = ParseNumbers(args, ':');
+      if (values.size() != 1) {
+        throw CImageParamsException();
+      }
+      if (name == "gamma") {
+        curve.Gamma(values[0], channels);
+      } else if (name == "threshold") {
+        curve.Threshold(values[0], channels);
+      } else {
+        curve.Contrast(values[0], channels);
+      }
+    } else if (name == "levels") {
+      std::vector<double> values = ParseNumbers(args, ':');
+      if (values.size() == 2) {
+        curve.Levels(values[0], values[1], 1, 0, -1, channels);
+      } else if (values.size() == 3) {
+        curve.Levels(values[0], values[1], values[2], 0, -1, channels);
+      } else if (values.size() == 5) {
+        curve.Levels(values[0], values[1], values[2], values[3], values[4], channels);
+      } else {
+        throw CImageParamsException();
+      }
+    } else if (name == "curves") {
+      std::vector<std::pair<double, double>> points;
+      size_t point_begin = 0;
+      while (point_begin <= args.size()) {
+        size_t point_end = std::min(args.find('/', point_begin), args.size());
+        std::vector<double> xy = ParseNumbers(args.substr(point_begin, point_end - point_begin), ':');
+        if (xy.size() != 2) {
+          throw CImageParamsException();
+        }
+        points.emplace_back(xy[0], xy[1]);
+        point_begin = point_end + 1;
+      }
+      curve.Curves(points, channels);
+    } else {
+      throw CImageParamsException();
+    }
+  }
+  return curve;
+}
+
+inline int CToneCurve::ParseChannels(const std::string &letters) {
+  const std::string names = "rgb";
+  int channels = 0;
+  for (char letter : letters) {
+    size_t c = names.find(letter);
+    if (c == std::string::npos) {
+      throw CImageParamsException();
+    }
+    channels |= 1 << c;
+  }
+  if (channels == 0) {
+    throw CImageParamsException();
+  }
+  return channels;
+}
+
+inline std::vector<double> CToneCurve::ParseNumbers(const std::string &text, char separator) {
+  std::vector<double> values;
+  size_t begin = 0;
+  while (begin <= text.size()) {
+    size_t end = std::min(text.find(separator, begin), text.size());
+    std::string number = text.substr(begin, end - begin);
+    size_t used = 0;
+    try {
+      values.push_back(std::stod(number, &used));
+    } catch (std::logic_error &) {
+      throw CImageParamsException();
+    }
+    if (used != number.size()) {
+      throw CImageParamsException();
+    }
+    begin = end + 1;
+  }
+  return values;
+}
+
+inline bool CToneCurve::AppliesTo(const Step &step, int channel) const {
+  return channel < 0 ? step.channels == ALL_CHANNELS : (step.channels >> channel & 1) != 0;
+}
+
+inline double CToneCurve::Evaluate(int channel, double val, int max_val) const {
+  double m = max_val;
+  val = std::min(std::max(val, 0.0), m);
+  for (const Step &step : steps_) {
+    if (AppliesTo(step, channel)) {
+      val = std::min(std::max(EvaluateStep(step, val, m), 0.0), m);
+    }
+  }
+  return val;
+}
+
+inline double CToneCurve::EvaluateStep(const Step &step, double val, double m) {
+  const std::vector<double> &a = step.args;
+  switch (step.op) {
+    case INVERT:
+      return m - val;
+    case GAMMA:
+      return pow(val / m, 1 / a[0]) * m;
+    case LEVELS: {
+      double t = std::min(std::max((val - a[0]) / (a[1] - a[0]), 0.0), 1.0);
+      double out_white = a[4] < 0 ? m : a[4];
+      return a[3] + pow(t, 1 / a[2]) * (out_white - a[3]);
+    }
+    case CURVES:
+      return EvaluateCurves(step, val);
+    case THRESHOLD:
+      return val >= a[0] ? m : 0;
+    case CONTRAST:
+      return (val - m / 2) * a[0] + m / 2;
+  }
+  return val;
+}
+
+// Cubic Hermite between the control points, flat outside them
+inline double CToneCurve::EvaluateCurves(const Step &step, double val) {
+  const std::vector<double> &xs = step.xs;
+  const std::vector<double> &ys = step.ys;
+  if (val <= xs.front()) {
+    return ys.front();
+  }
+  if (val >= xs.back()) {
+    return ys.back();
+  }
+  int i = int(std::upper_bound(xs.begin(), xs.end(), val) - xs.begin()) - 1;
+  double h = xs[i + 1] - xs[i];
+  double t = (val - xs[i]) / h;
+  double t2 = t * t, t3 = t2 * t;
+  return (2 * t3 - 3 * t2 + 1) * ys[i] + (t3 - 2 * t2 + t) * h * step.slopes[i] +
+      (3 * t2 - 2 * t3) * ys[i + 1] + (t3 - t2) * h * step.slopes[i + 1];
+}
+
+// Stored values above max_val are taken as max_val
+inline std::vector<uchar> CToneCurve::BuildTable(int channel, int max_val) const {
+  std::vector<uchar> table(256);
+  for (int i = 0; i < 256; i++) {
+    table[i] = (uchar) floor(Evaluate(channel, std::min(i, max_val), max_val) + 0.5);
+  }
+  return table;
+}
+
+template<class T>
+void CToneCurve::Apply(CImage<T> &img, int threads) const {
+  int channels = img.GetChannels();
+  bool shared = true;
+  for (const Step &step : steps_) {
+    shared = shared && step.channels == ALL_CHANNELS;
+  }
+  if (channels == 1 && !shared) {
+    throw CImageParamsException();
+  }
+  std::vector<std::vector<uchar>> tables;
+  if (channels == 1) {
+    tables.push_back(BuildTable(-1, img.GetMaxVal()));
+  } else if (shared) {
+    tables.push_back(BuildTable(0, img.GetMaxVal()));
+  } else {
+    for (int c = 0; c < channels; c++) {
+      tables.push_back(BuildTable(c, img.GetMaxVal()));
+    }
+  }
+  img.MapValues(tables, threads);
+}
+
+#endif //COMPUTERGEOMETRY_GRAPHICS_CTONECURVE_H
@@ -0,0 +1,403 @@
+#ifndef COMPUTERGEOMETRY_GRAPHICS_CTRANSFER_H
+#define COMPUTERGEOMETRY_GRAPHICS_CTRANSFER_H
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include "CTransferCurve.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+// The AVX2 kernels are compiled in whatever the build targets and picked at
+// run time
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define CTRANSFER_DISPATCH
+#endif
+
+typedef unsigned char uchar;
+
+// Transfer curve of an image between stored levels 0..max_val and linear
+// values scaled to [0, max_val], as tables built from one of the curves in
+// CTransferCurve.h. Only the constructor is instantiated for the curve; the
+// row kernels read the tables, or skip them for the identity.
+//
+// Decoding rows is a table lookup, gathered 8 at a time where the CPU has
+// AVX2. Encoding rows looks the level up in the slice table and steps it
+// against the thresholds, 8 lanes at a time with AVX2, and agrees with
+// Encode bit for bit. ApplyTable shuffles 32 bytes at once with AVX2.
+class CTransfer {
+ public:
+  // Empty, to be assigned a built one
+  CTransfer();
+
+  template<class Curve>
+  CTransfer(const Curve &curve, int max_val);
+
+  // The run time choice of curve: gamma 0 selects sRGB, 1 linear and
+  // anything else a power law
+  static CTransfer FromGamma(double gamma, int max_val);
+
+  double Decode(int level) const;
+
+  int Encode(double val) const;
+
+  // The smallest linear value stored as level
+  double GetThreshold(int level) const;
+
+  // src[x * stride] are stored levels
+  void DecodeRow(const uchar *src, int stride, float *dst, int n) const;
+
+  void EncodeRow(const float *src, uchar *dst, int stride, int n) const;
+
+  // 256 entries: the encode curve applied to a stored level (taken as
+  // linear), rounded; levels above max_val give max_val
+  const std::vector<uchar> &GetCorrectionTable() const;
+
+  // data[i] = table[data[i]] for 256 entry tables
+  static void ApplyTable(const uchar *table, uchar *data, size_t n);
+
+  // Whether the CPU runs the AVX2 kernels
+  static bool HasAvx2();
+
+ private:
+  static const int ENCODE_SIZE = 1 << 16;
+  static const int BLOCK = 64;
+
+  int max_val_;
+  bool linear_;
+
+  // decode_ maps a level to linear, threshold_[k] is the smallest linear
+  // value stored as k (with -inf / +inf at 0 and max_val + 1), and encode_
+  // gives a level at most a few steps below the right one for ENCODE_SIZE
+  // even slices of [0, max_val]
+  std::vector<double> decode_;
+  std::vector<double> threshold_;
+  std::vector<int> encode_;
+
+  // Float copies for the row kernels; a float compares against
+  // float_threshold_[k] exactly as it does against threshold_[k]
+  std::vector<float> float_decode_;
+  std::vector<float> float_threshold_;
+
+  std::vector<uchar> correction_;
+
+  // Curve applied to values in level units; exact for the identity, where
+  // level / m * m can be off by an ulp
+  template<class Curve>
+  static double DecodeLevel(const Curve &curve, double level, double m);
+
+  static double DecodeLevel(const CLinearCurve &curve, double level, double m);
+
+  template<class Curve>
+  static double EncodeLevel(const Curve &curve, double level, double m);
+
+  static double EncodeLevel(const CLinearCurve &curve, double level, double m);
+
+  template<class Curve>
+  static bool IsLinear(const Curve &curve);
+
+  static bool IsLinear(const CLinearCurve &curve);
+
+  void LinearLevels(const float *src, int *level, int n) const;
+
+#ifdef CTRANSFER_DISPATCH
+  __attribute__((target("avx2")))
+  static size_t ApplyTableAvx2(const uchar *table, uchar *data, size_t n);
+
+  __attribute__((target("avx2")))
+  void DecodeRowAvx2(const uchar *src, int stride, float *dst, int n) const;
+
+  __attribute__((target("avx2")))
+  void EncodeLevelsAvx2(const float *src, int *level, int n) const;
+#endif
+};
+
+inline CTransfer::CTransfer()
+    : max_val_(0), linear_(false) {
+}
+
+// Rounded levels change half way between the decoded levels, truncated ones
+// at the decoded level itself
+template<class Curve>
+CTransfer::CTransfer(const Curve &curve, int max_val)
+    : max_val_(max_val), linear_(IsLinear(curve)) {
+  const double m = max_val_;
+  const double step = Curve::ROUND ? 0.5 : 0;
+  decode_.resize(max_val_ + 1);
+  for (int i = 0; i <= max_val_; i++) {
+    decode_[i] = DecodeLevel(curve, i, m);
+  }
+  threshold_.resize(max_val_ + 2);
+  threshold_[0] = -HUGE_VAL;
+  threshold_[max_val_ + 1] = HUGE_VAL;
+  for (int k = 1; k <= max_val_; k++) {
+    threshold_[k] = DecodeLevel(curve, k - step, m);
+  }
+  encode_.resize(ENCODE_SIZE);
+  int level = 0;
+  for (int i = 0; i < ENCODE_SIZE; i++) {
+    double val = double(i) * max_val_ / ENCODE_SIZE;
+    while (level < max_val_ && val >= threshold_[level + 1]) {
+      level++;
+    }
+    encode_[i] = level;
+  }
+
+  float_decode_.resize(max_val_ + 1);
+  for (int i = 0; i <= max_val_; i++) {
+    float_decode_[i] = (float) decode_[i];
+  }
+  float_threshold_.resize(max_val_ + 2);
+  for (int k = 0; k <= max_val_ + 1; k++) {
+    float t = (float) threshold_[k];
+    if (t < threshold_[k]) {
+      t = std::nextafter(t, HUGE_VALF);
+    }
+    float_threshold_[k] = t;
+  }
+
+  correction_.resize(256);
+  for (int i = 0; i < 256; i++) {
+    double level = std::min<double>(i, max_val_);
+    correction_[i] = (uchar) std::min(int(EncodeLevel(curve, level, m) + 0.5), max_val_);
+  }
+}
+
+template<class Curve>
+double CTransfer::DecodeLevel(const Curve &curve, double level, double m) {
+  return curve.Decode(level / m) * m;
+}
+
+inline double CTransfer::DecodeLevel(const CLinearCurve &, double level, double) {
+  return level;
+}
+
+template<class Curve>
+double CTransfer::EncodeLevel(const Curve &curve, double level, double m) {
+  return curve.Encode(level / m) * m;
+}
+
+inline double CTransfer::EncodeLevel(const CLinearCurve &, double level, double) {
+  return level;
+}
+
+template<class Curve>
+bool CTransfer::IsLinear(const Curve &) {
+  return false;
+}
+
+inline bool CTransfer::IsLinear(const CLinearCurve &) {
+  return true;
+}
+
+inline CTransfer CTransfer::FromGamma(double gamma, int max_val) {
+  if (gamma == 0) {
+    return CTransfer(CSrgbCurve(), max_val);
+  }
+  if (gamma == 1) {
+    return CTransfer(CLinearCurve(), max_val);
+  }
+  return CTransfer(CPowerCurve(gamma), max_val);
+}
+
+inline double CTransfer::Decode(int level) const {
+  return decode_[level];
+}
+
+inline int CTransfer::Encode(double val) const {
+  if (!(val > 0)) {
+    return 0;
+  }
+  if (val >= max_val_) {
+    return max_val_;
+  }
+  int level = encode_[int(val * ENCODE_SIZE / max_val_)];
+  while (val >= threshold_[level + 1]) {
+    level++;
+  }
+  return level;
+}
+
+inline double CTransfer::GetThreshold(int level) const {
+  return threshold_[level];
+}
+
+inline void CTransfer::DecodeRow(const uchar *src, int stride, float *dst, int n) const {
+  if (linear_) {
+    for (int x = 0; x < n; x++) {
+      dst[x] = src[x * stride];
+    }
+    return;
+  }
+#ifdef CTRANSFER_DISPATCH
+  if (HasAvx2()) {
+    DecodeRowAvx2(src, stride, dst, n);
+    return;
+  }
+#endif
+  const float *table = float_decode_.data();
+  for (int x = 0; x < n; x++) {
+    dst[x] = table[src[x * stride]];
+  }
+}
+
+inline void CTransfer::EncodeRow(const float *src, uchar *dst, int stride, int n) const {
+  if (linear_) {
+    int level[BLOCK];
+    for (int x0 = 0; x0 < n; x0 += BLOCK) {
+      int len = std::min(n - x0, (int) BLOCK);
+      LinearLevels(src + x0, level, len);
+      for (int i = 0; i < len; i++) {
+        dst[(x0 + i) * stride] = (uchar) level[i];
+      }
+    }
+    return;
+  }
+#ifdef CTRANSFER_DISPATCH
+  if (HasAvx2()) {
+    int level[BLOCK];
+    for (int x0 = 0; x0 < n; x0 += BLOCK) {
+      int len = std::min(n - x0, (int) BLOCK);
+      EncodeLevelsAvx2(src + x0, level, len);
+      for (int i = 0; i < len; i++) {
+        dst[(x0 + i) * stride] = (uchar) level[i];
+      }
+    }
+    return;
+  }
+#endif
+  for (int x = 0; x < n; x++) {
+    dst[x * stride] = (uchar) Encode(src[x]);
+  }
+}
+
+inline const std::vector<uchar> &CTransfer::GetCorrectionTable() const {
+  return correction_;
+}
+
+inline void CTransfer::ApplyTable(const uchar *table, uchar *data, size_t n) {
+  size_t i = 0;
+#ifdef CTRANSFER_DISPATCH
+  if (HasAvx2()) {
+    i = ApplyTableAvx2(table, data, n);
+  }
+#endif
+  for (; i < n; i++) {
+    data[i] = table[data[i]];
+  }
+}
+
+// Rounds half up like Encode. The fraction is exact in float, where adding
+// 0.5 would round 0.49999997 up. NaN goes to 0
+inline void CTransfer::LinearLevels(const float *src, int *level, int n) const {
+  const float top = (float) max_val_;
+  int x = 0;
+#ifdef __SSE2__
+  const __m128 zero = _mm_setzero_ps();
+  const __m128 half = _mm_set1_ps(0.5f);
+  for (; x + 4 <= n; x += 4) {
+    __m128 val = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(src + x), zero), _mm_set1_ps(top));
+    __m128i k = _mm_cvttps_epi32(val);
+    __m128 up = _mm_cmpge_ps(_mm_sub_ps(val, _mm_cvtepi32_ps(k)), half);
+    _mm_storeu_si128((__m128i *) (level + x), _mm_sub_epi32(k, _mm_castps_si128(up)));
+  }
+#endif
+  for (; x < n; x++) {
+    float val = src[x] > 0 ? std::min(src[x], top) : 0;
+    int k = (int) val;
+    level[x] = k + (val - k >= 0.5f);
+  }
+}
+
+inline bool CTransfer::HasAvx2() {
+#ifdef CTRANSFER_DISPATCH
+  static const bool avx2 = __builtin_cpu_supports("avx2");
+  return avx2;
+#else
+  return false;
+#endif
+}
+
+#ifdef CTRANSFER_DISPATCH
+// The table is looked up in its 16 rows of 16 entries. Shuffles take the low
+// nibble as index and give 0 where bit 7 is set, so x ^ 16k plus 0x70,
+// saturated, only keeps the bytes of row k. Returns how many bytes it mapped
+inline size_t CTransfer::ApplyTableAvx2(const uchar *table, uchar *data, size_t n) {
+  __m256i rows[16];
+  for (int k = 0; k < 16; k++) {
+    rows[k] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) (table + 16 * k)));
+  }
+  const __m256i row_step = _mm256_set1_epi8(0x10);
+  const __m256i keep = _mm256_set1_epi8(0x70);
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m256i x = _mm256_loadu_si256((const __m256i *) (data + i));
+    __m256i out = _mm256_setzero_si256();
+    for (int k = 0; k < 16; k += 4) {
+      __m256i x0 = _mm256_adds_epu8(x, keep);
+      __m256i x1 = _mm256_adds_epu8(_mm256_xor_si256(x, row_step), keep);
+      x = _mm256_sub_epi8(x, _mm256_add_epi8(row_step, row_step));
+      __m256i x2 = _mm256_adds_epu8(x, keep);
+      __m256i x3 = _mm256_adds_epu8(_mm256_xor_si256(x, row_step), keep);
+      x = _mm256_sub_epi8(x, _mm256_add_epi8(row_step, row_step));
+      out = _mm256_or_si256(out, _mm256_or_si256(
+          _mm256_or_si256(_mm256_shuffle_epi8(rows[k], x0), _mm256_shuffle_epi8(rows[k + 1], x1)),
+          _mm256_or_si256(_mm256_shuffle_epi8(rows[k + 2], x2), _mm256_shuffle_epi8(rows[k + 3], x3))));
+    }
+    _mm256_storeu_si256((__m256i *) (data + i), out);
+  }
+  return i;
+}
+
+// 32 bit loads at the byte offsets of 8 pixels, low byte is the level;
+// src[(n - 1) * stride] is the last byte known to be readable
+inline void CTransfer::DecodeRowAvx2(const uchar *src, int stride, float *dst, int n) const {
+  const float *table = float_decode_.data();
+  int x = 0;
+  const __m256i offsets = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7),
+                                             _mm256_set1_epi32(stride));
+  const __m256i low_byte = _mm256_set1_epi32(0xFF);
+  for (; (x + 7) * stride + 3 <= (n - 1) * stride; x += 8) {
+    __m256i levels = _mm256_and_si256(
+        _mm256_i32gather_epi32((const int *) (src + x * stride), offsets, 1), low_byte);
+    _mm256_storeu_ps(dst + x, _mm256_i32gather_ps(table, levels, 4));
+  }
+  for (; x < n; x++) {
+    dst[x] = table[src[x * stride]];
+  }
+}
+
+// Encode on 8 lanes: the value is clamped to [0, max_val] (NaN to 0), the
+// slice gives a first level and the thresholds settle it. The float slice
+// index can land one past the double one, so a level may also step down
+inline void CTransfer::EncodeLevelsAvx2(const float *src, int *level, int n) const {
+  const int *encode = encode_.data();
+  const float *threshold = float_threshold_.data();
+  const __m256 zero = _mm256_setzero_ps();
+  const __m256 top = _mm256_set1_ps((float) max_val_);
+  const __m256 scale = _mm256_set1_ps((float) ENCODE_SIZE / max_val_);
+  const __m256 last = _mm256_set1_ps((float) (ENCODE_SIZE - 1));
+  int x = 0;
+  for (; x + 8 <= n; x += 8) {
+    __m256 val = _mm256_min_ps(_mm256_max_ps(_mm256_loadu_ps(src + x), zero), top);
+    __m256i slice = _mm256_cvttps_epi32(_mm256_min_ps(_mm256_mul_ps(val, scale), last));
+    __m256i k = _mm256_i32gather_epi32(encode, slice, 4);
+    __m256 below = _mm256_cmp_ps(val, _mm256_i32gather_ps(threshold, k, 4), _CMP_LT_OQ);
+    k = _mm256_add_epi32(k, _mm256_castps_si256(below));
+    while (true) {
+      __m256 above = _mm256_cmp_ps(val, _mm256_i32gather_ps(threshold + 1, k, 4), _CMP_GE_OQ);
+      if (_mm256_testz_ps(above, above)) {
+        break;
+      }
+      k = _mm256_sub_epi32(k, _mm256_castps_si256(above));
+    }
+    _mm256_storeu_si256((__m256i *) (level + x), k);
+  }
+  for (; x < n; x++) {
+    level[x] = Encode(src[x]);
+  }
+}
+#endif
+
+#endif //COMPUTERGEOMETRY_GRAPHICS_CTRANSFER_H
@@ -0,0 +1,52 @@
+#ifndef COMPUTERGEOMETRY_GRAPHICS_CTRANSFERCURVE_H
+#define COMPUTERGEOMETRY_GRAPHICS_CTRANSFERCURVE_H
+
+#include <cmath>
+
+// Exact transfer curves CTransfer builds its tables from, on values scaled to
+// [0, 1]: Decode takes a stored value to linear light and Encode back. ROUND
+// tells whether encoded levels are rounded or truncated. Only the table
+// building sees the curve; the row kernels run off the tables.
+struct CLinearCurve {
+  static const bool ROUND = true;
+
+  double Decode(double c) const {
+    return c;
+  }
+
+  double Encode(double c) const {
+    return c;
+  }
+};
+
+struct CPowerCurve {
+  static const bool ROUND = true;
+
+  explicit CPowerCurve(double gamma) : gamma_(gamma) {
+  }
+
+  double Decode(double c) const {
+    return pow(c, gamma_);
+  }
+
+  double Encode(double c) const {
+    return pow(c, 1 / gamma_);
+  }
+
+ private:
+  double gamma_;
+};
+
+struct CSrgbCurve {
+  static const bool ROUND = false;
+
+  double Decode(double c) const {
+    return c <= 0.04045 ? c / 12.92 : pow((c + 0.055) / 1.055, 2.4);
+  }
+
+  double Encode(double c) const {
+    return c <= 0.0031308 ? c * 12.92 : 1.055 * pow(c, 1 / 2.4) - 0.055;
+  }
+};
+
+#endif //COMPUTERGEOMETRY_GRAPHICS_CTRANSFERCURVE_H
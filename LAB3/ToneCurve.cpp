@@ -0,0 +1,68 @@
+#include <cstdio>
+#include <iostream>
+#include "CImage.h"
+#include "CToneCurve.h"
+
+// Applies a tone curve chain to a P5 or P6 image in one pass:
+//   LAB3_tone_curve <in> <out> <chain> [threads]
+// e.g. LAB3_tone_curve in.pgm out.pgm invert,gamma=2.2,levels=16:235
+// (see CToneCurve.h for the chain syntax)
+
+int ReadFileType(const std::string &fname) {
+  FILE *f = fopen(fname.c_str(), "rb");
+  if (!f) {
+    throw CImageFileOpenException();
+  }
+  int type = 0;
+  int i = fscanf(f, "P%i", &type);
+  fclose(f);
+  if (i != 1) {
+    throw CImageFileFormatException();
+  }
+  return type;
+}
+
+template<class T>
+void ApplyChain(const std::string &fin, const std::string &fout, const CToneCurve &curve,
+                int threads) {
+  CImage<T> img = CImage<T>(fin, 1);
+  curve.Apply(img, threads);
+  img.WriteImg(fout);
+}
+
+int main(int argc, char *argv[]) {
+  try {
+    if (argc == 4 || argc == 5) {
+      std::string fin = argv[1];
+      std::string fout = argv[2];
+      CToneCurve curve = CToneCurve::Parse(argv[3]);
+      int threads = 0;
+      if (argc == 5) {
+        try {
+          threads = std::stoi(argv[4]);
+        } catch (std::logic_error &) {
+          throw CImageParamsException();
+        }
+      }
+      switch (ReadFileType(fin)) {
+        case P5: {
+          ApplyChain<CMonoPixel>(fin, fout, curve, threads);
+          break;
+        }
+        case P6: {
+          ApplyChain<CColorPixel>(fin, fout, curve, threads);
+          break;
+        }
+        default: {
+          throw CImageFileFormatException();
+        }
+      }
+    } else {
+      throw CImageParamsException();
+    }
+  } catch (CImageException e) {
+    std::cerr << e.getErr() << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,326 @@
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <random>
+#include <string>
+#include <cstring>
+#include <thread>
+#include "CImage.h"
+#include "CToneCurve.h"
+#include "CTransfer.h"
+
+// Checks the transfer row kernels against CTransfer::Encode / Decode and
+// reports their throughput next to per-value pow, then times
+// CorrectImageWithGamma on a 3000x3000 P6 frame against memcpy.
+//   TransferBench [values]
+// Exits with 1 when a row kernel disagrees with CTransfer::Encode / Decode
+// anywhere, an encoded level is more than 0.5 LSB from the exact curve (from
+// the middle of the level's range for truncated curves), the gamma correction differs from the rounded curve, or
+// CToneCurve parses a chain wrongly or maps a channel off its table.
+
+double Seconds(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+std::string CurveName(double gamma) {
+  return gamma == 0 ? std::string("sRGB") : "gamma " + std::to_string(gamma).substr(0, 4);
+}
+
+// Two floats either side of every threshold and an even sweep, with the
+// out of range values mixed in
+std::vector<float> TestValues(const CTransfer &transfer, int max_val) {
+  std::vector<float> values;
+  for (int k = 1; k <= max_val; k++) {
+    float t = (float) transfer.GetThreshold(k);
+    for (int i = -2; i <= 2; i++) {
+      float v = t;
+      for (int j = 0; j < std::abs(i); j++) {
+        v = std::nextafter(v, i < 0 ? -HUGE_VALF : HUGE_VALF);
+      }
+      values.push_back(v);
+    }
+  }
+  const int steps = 1 << 20;
+  for (int i = 0; i <= steps; i++) {
+    values.push_back(float(double(i) * max_val / steps));
+  }
+  values.push_back(-1);
+  values.push_back(max_val + 1.0f);
+  values.push_back(HUGE_VALF);
+  values.push_back(NAN);
+  values.push_back(FLT_MIN);
+  return values;
+}
+
+// Calls fn with the curve CTransfer::FromGamma builds from for gamma
+template<class Fn>
+void WithCurve(double gamma, Fn fn) {
+  if (gamma == 0) {
+    fn(CSrgbCurve());
+  } else if (gamma == 1) {
+    fn(CLinearCurve());
+  } else {
+    fn(CPowerCurve(gamma));
+  }
+}
+
+template<class Curve>
+bool Check(const Curve &curve, double gamma, int max_val) {
+  CTransfer transfer = CTransfer::FromGamma(gamma, max_val);
+  std::vector<float> values = TestValues(transfer, max_val);
+  int n = values.size();
+
+  std::vector<uchar> levels(n);
+  transfer.EncodeRow(values.data(), levels.data(), 1, n);
+  int encode_mismatch = 0;
+  double max_err = 0;
+  const double center = Curve::ROUND ? 0 : 0.5;
+  for (int i = 0; i < n; i++) {
+    encode_mismatch += levels[i] != transfer.Encode(values[i]);
+    double v = values[i];
+    if (v >= 0 && v <= max_val) {
+      double exact = curve.Encode(v / max_val) * max_val;
+      max_err = std::max(max_err, std::fabs(exact - center - levels[i]));
+    }
+  }
+
+  // Channel 1 of an interleaved row exercises the strided path
+  std::vector<uchar> stored(3 * (max_val + 1));
+  for (int i = 0; i <= max_val; i++) {
+    stored[3 * i + 1] = (uchar) (max_val - i);
+  }
+  std::vector<float> plain(max_val + 1), strided(max_val + 1);
+  std::vector<uchar> ramp(max_val + 1);
+  for (int i = 0; i <= max_val; i++) {
+    ramp[i] = (uchar) i;
+  }
+  transfer.DecodeRow(ramp.data(), 1, plain.data(), max_val + 1);
+  transfer.DecodeRow(stored.data() + 1, 3, strided.data(), max_val + 1);
+  int decode_mismatch = 0;
+  for (int i = 0; i <= max_val; i++) {
+    decode_mismatch += plain[i] != (float) transfer.Decode(i);
+    decode_mismatch += strided[i] != (float) transfer.Decode(max_val - i);
+  }
+
+  bool ok = max_err <= 0.5 + 1e-9 && encode_mismatch == 0 && decode_mismatch == 0;
+  std::cout << std::left << std::setw(10) << CurveName(gamma) << std::right << std::setw(4)
+            << max_val << std::setw(14) << std::fixed << std::setprecision(6) << max_err
+            << std::setw(11) << encode_mismatch << std::setw(11) << decode_mismatch
+            << "  " << (ok ? "ok" : "FAILED") << "\n";
+  return ok;
+}
+
+template<class Curve>
+void Throughput(const Curve &curve, double gamma, int n) {
+  const int max_val = 255;
+  CTransfer transfer = CTransfer::FromGamma(gamma, max_val);
+  std::mt19937 gen(7);
+  std::uniform_real_distribution<float> dist(0, max_val);
+  std::vector<float> values(n);
+  for (float &v : values) {
+    v = dist(gen);
+  }
+  std::vector<uchar> levels(n);
+  std::vector<float> decoded(n);
+  double bias = Curve::ROUND ? 0.5 : 0;
+  long long sum = 0;
+
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < n; i++) {
+    levels[i] = (uchar) (curve.Encode(values[i] / max_val) * max_val + bias);
+  }
+  double encode_pow = Seconds(start);
+  sum += levels[n / 2];
+
+  start = std::chrono::steady_clock::now();
+  for (int i = 0; i < n; i++) {
+    levels[i] = (uchar) transfer.Encode(values[i]);
+  }
+  double encode_table = Seconds(start);
+  sum += levels[n / 2];
+
+  start = std::chrono::steady_clock::now();
+  transfer.EncodeRow(values.data(), levels.data(), 1, n);
+  double encode_row = Seconds(start);
+  sum += levels[n / 2];
+
+  start = std::chrono::steady_clock::now();
+  for (int i = 0; i < n; i++) {
+    decoded[i] = (float) (curve.Decode(double(levels[i]) / max_val) * max_val);
+  }
+  double decode_pow = Seconds(start);
+  sum += (long long) decoded[n / 2];
+
+  start = std::chrono::steady_clock::now();
+  transfer.DecodeRow(levels.data(), 1, decoded.data(), n);
+  double decode_row = Seconds(start);
+  sum += (long long) decoded[n / 2];
+
+  double mega = n / 1e6;
+  std::cout << std::left << std::setw(10) << CurveName(gamma) << std::right << std::fixed
+            << std::setprecision(0) << std::setw(10) << mega / encode_pow << std::setw(10)
+            << mega / encode_table << std::setw(10) << mega / encode_row << std::setw(10)
+            << mega / decode_pow << std::setw(10) << mega / decode_row << (sum < 0 ? " " : "")
+            << "\n";
+}
+
+template<class T, class Curve>
+int CorrectionMismatches(const Curve &curve, double gamma) {
+  const int w = 257, h = 5;
+  CImage<T> img(w, h, 255, sizeof(T) == 1 ? P5 : P6, gamma);
+  std::mt19937 gen(11);
+  uchar *data = (uchar *) img[0];
+  for (int i = 0; i < w * h * (int) sizeof(T); i++) {
+    data[i] = (uchar) gen();
+  }
+  std::vector<uchar> before(data, data + w * h * sizeof(T));
+  img.CorrectImageWithGamma(3);
+  int mismatch = 0;
+  for (size_t i = 0; i < before.size(); i++) {
+    mismatch += data[i] != (int) (curve.Encode(before[i] / 255.0) * 255 + 0.5);
+  }
+  return mismatch;
+}
+
+// Counts the chains parsed against expectation; a chain is good when it
+// parses and, applied to a P5 image, throws exactly when expected
+int ParseMismatches() {
+  struct Case {
+    const char *chain;
+    bool parses;
+    bool mono;
+  };
+  const Case cases[] = {
+      {"invert", true, true},
+      {"gamma=2.2,levels=16:235", true, true},
+      {"levels=16:235:1.2:10:240", true, true},
+      {"curves=0:0/128:160/255:255,threshold=100,contrast=1.5", true, true},
+      {"invert.r", true, false},
+      {"gamma.gb=1.8,invert", true, false},
+      {"", false, false},
+      {"gamma", false, false},
+      {"gamma=0", false, false},
+      {"gamma=2.2x", false, false},
+      {"levels=5:5", false, false},
+      {"levels=0:255:1:0", false, false},
+      {"curves=0:0", false, false},
+      {"curves=10:0/5:255", false, false},
+      {"invert.x", false, false},
+      {"invert=1", false, false},
+      {"blur=2", false, false},
+  };
+  int mismatch = 0;
+  for (const Case &c : cases) {
+    bool parses = true, mono = true;
+    try {
+      CToneCurve curve = CToneCurve::Parse(c.chain);
+      CImage<CMonoPixel> img(4, 1, 255, P5, 1);
+      try {
+        curve.Apply(img);
+      } catch (CImageParamsException &) {
+        mono = false;
+      }
+    } catch (CImageParamsException &) {
+      parses = false;
+      mono = false;
+    }
+    if (parses != c.parses || mono != c.mono) {
+      std::cout << "CToneCurve::Parse(\"" << c.chain << "\") " << (parses ? "parses" : "throws")
+                << (parses ? mono ? ", applies to P5" : ", rejected on P5" : "") << "\n";
+      mismatch++;
+    }
+  }
+  return mismatch;
+}
+
+// Every channel of a mapped image against the table built for it
+template<class T>
+int ToneCurveMismatches(const std::string &chain) {
+  const int w = 257, h = 5, channels = sizeof(T);
+  CToneCurve curve = CToneCurve::Parse(chain);
+  CImage<T> img(w, h, 255, sizeof(T) == 1 ? P5 : P6, 1);
+  std::mt19937 gen(17);
+  uchar *data = (uchar *) img[0];
+  for (int i = 0; i < w * h * channels; i++) {
+    data[i] = (uchar) gen();
+  }
+  std::vector<uchar> before(data, data + w * h * channels);
+  curve.Apply(img, 3);
+  int mismatch = 0;
+  for (int c = 0; c < channels; c++) {
+    std::vector<uchar> table = curve.BuildTable(channels == 1 ? -1 : c, 255);
+    for (size_t i = c; i < before.size(); i += channels) {
+      mismatch += data[i] != table[before[i]];
+    }
+  }
+  return mismatch;
+}
+
+void CorrectionThroughput(int threads) {
+  const int size = 3000;
+  CImage<CColorPixel> img(size, size, 255, P6, 2.2);
+  std::vector<uchar> copy((size_t) size * size * 3);
+  uchar *data = (uchar *) img[0];
+  std::mt19937 gen(13);
+  for (size_t i = 0; i < copy.size(); i++) {
+    data[i] = (uchar) gen();
+  }
+  const int reps = 5;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < reps; i++) {
+    memcpy(copy.data(), data, copy.size());
+    data[i] = copy[copy.size() - 1 - i];
+  }
+  double copy_time = Seconds(start) / reps;
+  start = std::chrono::steady_clock::now();
+  for (int i = 0; i < reps; i++) {
+    img.CorrectImageWithGamma(threads);
+  }
+  double correct_time = Seconds(start) / reps;
+  std::cout << "CorrectImageWithGamma, " << (threads ? std::to_string(threads) : "default")
+            << " threads (" << std::thread::hardware_concurrency() << " cores): " << std::setprecision(2) << copy.size() / correct_time / 1e9
+            << " GB/s, memcpy " << copy.size() / copy_time / 1e9 << " GB/s\n";
+}
+
+int main(int argc, char *argv[]) {
+  int n = argc > 1 ? std::stoi(argv[1]) : 1 << 24;
+#ifdef __SSE2__
+  std::cout << "kernels: " << (CTransfer::HasAvx2() ? "AVX2" : "SSE2") << "\n";
+#else
+  std::cout << "kernels: scalar\n";
+#endif
+  const double gammas[] = {0, 2.2, 1.8, 1, 0.6};
+  bool ok = true;
+  std::cout << "curve      max   max err LSB  encode !=  decode !=\n";
+  for (double gamma : gammas) {
+    WithCurve(gamma, [&](const auto &curve) {
+      ok = Check(curve, gamma, 255) && ok;
+      ok = Check(curve, gamma, 100) && ok;
+      int mismatch = CorrectionMismatches<CMonoPixel>(curve, gamma) +
+          CorrectionMismatches<CColorPixel>(curve, gamma);
+      if (mismatch) {
+        std::cout << "CorrectImageWithGamma, " << CurveName(gamma) << ": " << mismatch
+                  << " values differ from the rounded curve\n";
+        ok = false;
+      }
+    });
+  }
+  int tone_mismatch = ParseMismatches() +
+      ToneCurveMismatches<CMonoPixel>("gamma=2.2,levels=16:235,curves=0:0/128:160/255:255") +
+      ToneCurveMismatches<CColorPixel>("invert.r,gamma=2.2,contrast.gb=1.5,levels.b=16:235") +
+      ToneCurveMismatches<CColorPixel>("invert,threshold=128");
+  if (tone_mismatch) {
+    std::cout << "CToneCurve: " << tone_mismatch << " mismatches\n";
+    ok = false;
+  }
+  std::cout << "\nMvalues/s  encode pow     table       row  decode pow       row\n";
+  for (double gamma : gammas) {
+    WithCurve(gamma, [&](const auto &curve) {
+      Throughput(curve, gamma, n);
+    });
+  }
+  std::cout << "\n";
+  CorrectionThroughput(1);
+  CorrectionThroughput(0);
+  return ok ? 0 : 1;
+}
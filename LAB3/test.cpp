@@ -10,7 +10,7 @@
 int main() {
   try {
     for (int i = 1; i <= 8; i++) {
-      CImage<CColorPixel> img = CImage<CColorPixel>("forest_sample.pnm");
+      CImage<CColorPixel> img = CImage<CColorPixel>("forest_sample.pnm", 2.2);
       CDitherer<CColorPixel> ditherer = CDitherer<CColorPixel>(img);
       ditherer.DoFloydSteinbergDithering(i);
       img.WriteImg("forest_floyd_sample" + std::to_string(i) + ".pnm");